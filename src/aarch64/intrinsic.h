@@ -160,12 +160,31 @@ static ALWAYS_INLINE void arch_tlbi_vmalle1is()
     arch_fence();
 }
 
-/* Set Translation Table Base Register 0 (EL1). */
+/* Flush the TLB entries of page `va` in address space `asid`. */
+static ALWAYS_INLINE void arch_tlbi_vae1is(u64 asid, u64 va)
+{
+    arch_fence();
+    asm volatile("tlbi vae1is, %[x]"
+                 :
+                 : [x] "r"(asid << 48 | ((va >> 12) & 0xFFFFFFFFFFF)));
+    arch_fence();
+}
+
+/* Flush all TLB entries of address space `asid`. */
+static ALWAYS_INLINE void arch_tlbi_aside1is(u64 asid)
+{
+    arch_fence();
+    asm volatile("tlbi aside1is, %[x]" : : [x] "r"(asid << 48));
+    arch_fence();
+}
+
+/* Set Translation Table Base Register 0 (EL1). The ASID goes in bits
+   [63:48], and entries of other ASIDs stay in the TLB. */
 static ALWAYS_INLINE void arch_set_ttbr0(u64 addr)
 {
     arch_fence();
     asm volatile("msr ttbr0_el1, %[x]" : : [x] "r"(addr));
-    arch_tlbi_vmalle1is();
+    arch_isb();
 }
 
 /* Get Translation Table Base Register 0 (EL1). */
@@ -3,6 +3,8 @@
 #include <common/defines.h>
 typedef unsigned long long u64;
 #define PAGE_SIZE 4096
+// the size of a page mapped by a level 2 block entry.
+#define HUGE_PAGE_SIZE (1 << 21)
 
 /* Memory region attributes */
 #define MT_DEVICE_nGnRnE 0x0
@@ -27,19 +29,25 @@ typedef unsigned long long u64;
 #define PTE_TABLE 0x3
 #define PTE_BLOCK 0x1
 #define PTE_PAGE 0x3
+#define PTE_IS_BLOCK(pte) (((pte) & PTE_TABLE) == PTE_BLOCK)
 
 #define PTE_KERNEL (0 << 6)
 #define PTE_USER (1 << 6)
 #define PTE_RO (1 << 7)
 #define PTE_RW (0 << 7)
+// not global: the entry belongs to the ASID it was loaded under.
+#define PTE_NG (1 << 11)
 
 #define PTE_KERNEL_DATA (PTE_KERNEL | PTE_NORMAL | PTE_BLOCK)
 #define PTE_KERNEL_DEVICE (PTE_KERNEL | PTE_DEVICE | PTE_BLOCK)
-#define PTE_USER_DATA (PTE_USER | PTE_NORMAL | PTE_PAGE)
+#define PTE_USER_DATA (PTE_USER | PTE_NG | PTE_NORMAL | PTE_PAGE)
 
 #define N_PTE_PER_TABLE 512
 
 #define PTE_HIGH_NX (1LL << 54)
+// software bit: the page of a shared file mapping was written since its
+// last writeback.
+#define PTE_DIRTY (1LL << 55)
 
 #define KSPACE_MASK 0xFFFF000000000000
 
@@ -64,6 +72,7 @@ typedef PTEntry *PTEntriesPtr;
 #define PTE_FLAGS(pte) ((pte) & 0xFFFF000000000FFF)
 #define P2N(addr) (addr >> 12)
 #define PAGE_BASE(addr) ((u64)addr & ~(PAGE_SIZE - 1))
+#define HUGE_PAGE_BASE(addr) ((u64)(addr) & ~(u64)(HUGE_PAGE_SIZE - 1))
 
 #define VA_PART0(va) (((u64)(va) & 0xFF8000000000) >> 39)
 #define VA_PART1(va) (((u64)(va) & 0x7FC0000000) >> 30)
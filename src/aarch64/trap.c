@@ -35,7 +35,9 @@ void trap_global_handler(UserContext *context)
     case ESR_EC_IABORT_EL1:
     case ESR_EC_DABORT_EL0:
     case ESR_EC_DABORT_EL1: {
-        pgfault_handler(iss);
+        // an access that no mapping allows kills the process.
+        if (pgfault_handler(iss) < 0)
+            thisproc()->killed = true;
     } break;
     default: {
         printk("Unknwon exception %llu\n", esr);
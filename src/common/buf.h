@@ -6,8 +6,9 @@
 #define BSIZE 512
 #define B_VALID 0x2 // Buffer has been read from disk.
 #define B_DIRTY 0x4 // Buffer needs to be written to disk.
+#define BUF_MAX_SEG 8 // Data segments in one scatter-gather request.
 
-typedef struct {
+typedef struct Buf {
     int flags;
     u8 data[BSIZE];
     u32 block_no;
@@ -15,3 +16,24 @@ typedef struct {
     /* @todo: It depends on you to add other necessary elements. */
     Semaphore sem;
 } Buf;
+
+/**
+    a block request without a payload of its own: the device reads or writes
+    the caller's memory described by `seg`, starting at sector `block_no`.
+    small enough to live on a kernel stack.
+ */
+typedef struct BlkReq {
+    int flags;
+    u32 block_no;
+    // posted once the request has completed, unless it has `end_io`.
+    Semaphore sem;
+    // completion callback, run in interrupt context. NULL posts `sem` instead.
+    void (*end_io)(struct BlkReq *r);
+    void *private;
+    // scatter-gather list, filled by virtio_blk_map.
+    u32 nseg;
+    struct {
+        u8 *addr;
+        u32 len;
+    } seg[BUF_MAX_SEG];
+} BlkReq;
@@ -25,6 +25,9 @@ typedef unsigned long long u64;
 typedef i64 isize;
 typedef u64 usize;
 
+// the number of CPUs the kernel runs on.
+#define NCPU 4
+
 /* Efficient min and max operations */
 #define MIN(_a, _b)             \
     ({                          \
@@ -71,6 +71,7 @@ struct virtq_avail {
     u16 flags;
     u16 idx;
     u16 ring[NQUEUE];
+    u16 used_event; // only with VIRTIO_RING_F_EVENT_IDX.
 } __attribute__((packed, aligned(2)));
 
 struct virtq_used_elem {
@@ -83,6 +84,7 @@ struct virtq_used {
     u16 flags;
     u16 idx;
     struct virtq_used_elem ring[NQUEUE];
+    u16 avail_event; // only with VIRTIO_RING_F_EVENT_IDX.
 } __attribute__((packed, aligned(4)));
 
 struct virtq {
@@ -96,7 +98,7 @@ struct virtq {
     struct {
         volatile u8 status;
         volatile u8 done;
-        u8 *buf;
+        BlkReq *req;
     } info[NQUEUE];
 };
 
@@ -105,6 +107,11 @@ struct virtq {
 #define VIRTIO_BLK_T_FLUSH 4
 #define VIRTIO_BLK_T_DISCARD 11
 #define VIRTIO_BLK_T_WRITE_ZEROES 13
+// device configuration space, valid fields depend on the negotiated features.
+#define VIRTIO_BLK_CFG_SIZE_MAX (VIRTIO_REG_CONFIG + 0x08)
+#define VIRTIO_BLK_CFG_SEG_MAX (VIRTIO_REG_CONFIG + 0x0c)
+#define VIRTIO_BLK_CFG_BLK_SIZE (VIRTIO_REG_CONFIG + 0x14)
+
 struct virtio_blk_req_hdr {
     u32 type;
     u32 reserved;
@@ -116,5 +123,39 @@ enum diskop {
     DWRITE,
 };
 
+/**
+    queue `n` requests on the ring and notify the device once for the whole
+    batch. each request completes through its `end_io` callback, or by posting
+    its `sem` when it has none. blocks while the ring is full.
+ */
+void virtio_blk_submit(BlkReq **reqs, int n);
+// wait for a request queued by virtio_blk_submit without `end_io`.
+void virtio_blk_wait(BlkReq *r);
+/**
+    describe the buffer `addr[0..len)` as the data of a multi-sector request
+    `r`, split into page-sized scatter-gather segments within the limits the
+    device advertised (SEG_MAX, SIZE_MAX). returns the number of bytes
+    covered, a multiple of the device block size; the caller issues the rest
+    in further requests. the device accesses `addr` directly, no copy is made.
+ */
+usize virtio_blk_map(BlkReq *r, u8 *addr, usize len);
+/**
+    append `addr[0..len)` to the data of `r`, whose `nseg` is set, so that
+    the request goes on to the sectors right after the ones mapped so far.
+    `len` is a multiple of the sector size. returns false and leaves `r`
+    untouched if the segments left cannot hold all of it.
+ */
+bool virtio_blk_map_more(BlkReq *r, u8 *addr, usize len);
+// submit `r` alone and wait for it.
+void virtio_blk_rw_req(BlkReq *r);
 int virtio_blk_rw(Buf *b);
+typedef struct {
+    u64 requests;    // requests submitted.
+    u64 notifies;    // QUEUE_NOTIFY writes, i.e. device kicks.
+    u64 interrupts;  // interrupts taken.
+    u64 completions; // requests reaped by the interrupt handler.
+} VirtioBlkStats;
+
+// interrupts / completions is the interrupts-per-I/O ratio.
+void virtio_blk_stats(VirtioBlkStats *stats);
 void virtio_init(void);
@@ -6,12 +6,30 @@
 #include <common/string.h>
 #include <kernel/mem.h>
 #include <kernel/printk.h>
+#include <aarch64/mmu.h>
 
 #define VIRTIO_MAGIC 0x74726976
 
 struct disk {
     SpinLock lk;
     struct virtq virtq;
+    // request headers, indexed by the head descriptor of each chain.
+    struct virtio_blk_req_hdr hdr[NQUEUE];
+    // submitters sleeping for free descriptors.
+    int nwaiting;
+    Semaphore free_sem;
+    // requests handed to the device and not yet reaped.
+    u16 inflight;
+    // avail->idx at the last kick.
+    u16 notified_idx;
+    // negotiated VIRTIO_RING_F_INDIRECT_DESC and VIRTIO_RING_F_EVENT_IDX.
+    bool indirect, event_idx;
+    // indirect descriptor tables, indexed by the head descriptor.
+    struct virtq_desc table[NQUEUE][BUF_MAX_SEG + 2];
+    VirtioBlkStats stats;
+    // request limits: data segments per request, bytes per segment and
+    // the logical block size of the device.
+    u32 seg_max, size_max, blk_size;
 } disk;
 
 static void desc_init(struct virtq *virtq)
@@ -26,9 +44,7 @@ static void desc_init(struct virtq *virtq)
 
 static int alloc_desc(struct virtq *virtq)
 {
-    if (virtq->nfree == 0) {
-        PANIC();
-    }
+    ASSERT(virtq->nfree > 0);
 
     u16 d = virtq->free_head;
     if (virtq->desc[d].flags & VIRTQ_DESC_F_NEXT)
@@ -57,76 +73,238 @@ static void free_desc(struct virtq *virtq, u16 n)
     virtq->free_head = head;
 }
 
-int virtio_blk_rw(Buf *b)
+/* descriptors in the chain of a request: header, data segments and status. */
+static INLINE int req_ndesc(BlkReq *b)
 {
-    enum diskop op = DREAD;
-    if (b->flags & B_DIRTY)
-        op = DWRITE;
-    
-    init_sem(&b->sem, 0);
-
-    u64 sector = b->block_no;
-    struct virtio_blk_req_hdr hdr;
-
-    if (op == DREAD)
-        hdr.type = VIRTIO_BLK_T_IN;
-    else if (op == DWRITE)
-        hdr.type = VIRTIO_BLK_T_OUT;
-    else
-        return -1;
-    hdr.reserved = 0;
-    hdr.sector = sector;
+    return (int)b->nseg + 2;
+}
 
-    acquire_spinlock(&disk.lk);
+/* ring descriptors taken by a request. */
+static INLINE int req_nring(BlkReq *b)
+{
+    return disk.indirect ? 1 : req_ndesc(b);
+}
 
+/*
+ * Queue `b` on the available ring. The device is not notified here, so a
+ * whole batch can be published with a single QUEUE_NOTIFY.
+ */
+static void queue_req(BlkReq *b)
+{
     int d0 = alloc_desc(&disk.virtq);
-    if (d0 < 0)
-        return -1;
-    disk.virtq.desc[d0].addr = (u64)V2P(&hdr);
-    disk.virtq.desc[d0].len = sizeof(hdr);
-    disk.virtq.desc[d0].flags = VIRTQ_DESC_F_NEXT;
-
-    int d1 = alloc_desc(&disk.virtq);
-    if (d1 < 0)
-        return -1;
-    disk.virtq.desc[d0].next = d1;
-    disk.virtq.desc[d1].addr = (u64)V2P(b->data);
-    disk.virtq.desc[d1].len = 512;
-    disk.virtq.desc[d1].flags = VIRTQ_DESC_F_NEXT;
-    if (op == DREAD)
-        disk.virtq.desc[d1].flags |= VIRTQ_DESC_F_WRITE;
-
-    int d2 = alloc_desc(&disk.virtq);
-    if (d2 < 0)
-        return -1;
-    disk.virtq.desc[d1].next = d2;
-    disk.virtq.desc[d2].addr = (u64)V2P(&disk.virtq.info[d0].status);
-    disk.virtq.desc[d2].len = sizeof(disk.virtq.info[d0].status);
-    disk.virtq.desc[d2].flags = VIRTQ_DESC_F_WRITE;
-    disk.virtq.desc[d2].next = 0;
+    int n = req_ndesc(b);
+
+    // with indirect descriptors the whole chain lives in the table of the
+    // head slot, and the ring holds a single descriptor pointing at it.
+    struct virtq_desc *tab = disk.virtq.desc;
+    int id[BUF_MAX_SEG + 2];
+    if (disk.indirect) {
+        tab = disk.table[d0];
+        for (int i = 0; i < n; i++)
+            id[i] = i;
+    } else {
+        id[0] = d0;
+        for (int i = 1; i < n; i++)
+            id[i] = alloc_desc(&disk.virtq);
+    }
+
+    struct virtio_blk_req_hdr *hdr = &disk.hdr[d0];
+    hdr->type = (b->flags & B_DIRTY) ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    hdr->reserved = 0;
+    hdr->sector = b->block_no;
+    tab[id[0]].addr = (u64)V2P(hdr);
+    tab[id[0]].len = sizeof(*hdr);
+
+    for (int i = 1; i < n - 1; i++) {
+        tab[id[i]].addr = (u64)V2P(b->seg[i - 1].addr);
+        tab[id[i]].len = b->seg[i - 1].len;
+    }
+
+    disk.virtq.info[d0].status = 0xff;
+    disk.virtq.info[d0].done = 0;
+    disk.virtq.info[d0].req = b;
+    tab[id[n - 1]].addr = (u64)V2P(&disk.virtq.info[d0].status);
+    tab[id[n - 1]].len = sizeof(disk.virtq.info[d0].status);
+
+    for (int i = 0; i < n; i++) {
+        u16 flags = 0;
+        if (i < n - 1) {
+            flags |= VIRTQ_DESC_F_NEXT;
+            tab[id[i]].next = (u16)id[i + 1];
+        } else {
+            tab[id[i]].next = 0;
+        }
+        if (i == n - 1 || (i > 0 && !(b->flags & B_DIRTY)))
+            flags |= VIRTQ_DESC_F_WRITE;
+        tab[id[i]].flags = flags;
+    }
+
+    if (disk.indirect) {
+        disk.virtq.desc[d0].addr = (u64)V2P(tab);
+        disk.virtq.desc[d0].len = (u32)(n * sizeof(struct virtq_desc));
+        disk.virtq.desc[d0].flags = VIRTQ_DESC_F_INDIRECT;
+        disk.virtq.desc[d0].next = 0;
+    }
 
     disk.virtq.avail->ring[disk.virtq.avail->idx % NQUEUE] = d0;
+    arch_fence();
     disk.virtq.avail->idx++;
+    disk.inflight++;
+}
 
-    disk.virtq.info[d0].buf = b->data;
+/* see the virtio spec, 2.7.10: does moving from `old` to `new` pass `event`? */
+static INLINE bool need_event(u16 event, u16 new, u16 old)
+{
+    return (u16)(new - event - 1) < (u16)(new - old);
+}
 
+/*
+ * Ask for the next interrupt only once every request now in flight has
+ * completed, so a batch is reaped by a single interrupt.
+ */
+static void arm_used_event()
+{
+    if (!disk.event_idx)
+        return;
+    u16 last = disk.virtq.last_used_idx;
+    disk.virtq.avail->used_event =
+        (u16)(last + (disk.inflight ? disk.inflight - 1 : 0));
     arch_fence();
-    REG(VIRTIO_REG_QUEUE_NOTIFY) = 0;
-    arch_fence();
+}
 
-    /* LAB 4 TODO 1 BEGIN */
-    disk.virtq.info[d0].done = 0;
-    disk.virtq.info[d0].status = 0;
-    release_spinlock(&disk.lk);
-    while (disk.virtq.info[d0].done == 0){
-        if(!wait_sem(&b->sem))PANIC();
+usize virtio_blk_map(BlkReq *b, u8 *addr, usize len)
+{
+    usize mapped = 0;
+    b->nseg = 0;
+    while (mapped < len && b->nseg < disk.seg_max) {
+        u8 *p = addr + mapped;
+        // kernel memory is linearly mapped, so a segment may run to the end
+        // of the page; crossing it is left to the next segment.
+        usize n = MIN(len - mapped, PAGE_SIZE - ((u64)p % PAGE_SIZE));
+        n = MIN(n, (usize)disk.size_max);
+        b->seg[b->nseg].addr = p;
+        b->seg[b->nseg].len = (u32)n;
+        b->nseg++;
+        mapped += n;
     }
-    acquire_spinlock(&disk.lk);
-    /* LAB 4 TODO 1 END */
+    // the request must end on a sector boundary, which is also a device
+    // block boundary as blk_size divides BSIZE.
+    usize tail = mapped % BSIZE;
+    while (tail > 0) {
+        ASSERT(b->nseg > 0);
+        u32 *last = &b->seg[b->nseg - 1].len;
+        usize cut = MIN(tail, (usize)*last);
+        *last -= (u32)cut;
+        if (*last == 0)
+            b->nseg--;
+        mapped -= cut;
+        tail -= cut;
+    }
+    ASSERT(mapped > 0);
+    return mapped;
+}
 
-    disk.virtq.info[d0].done = 0;
-    free_desc(&disk.virtq, d0);
+bool virtio_blk_map_more(BlkReq *b, u8 *addr, usize len)
+{
+    u32 nseg = b->nseg;
+    u32 last = nseg > 0 ? b->seg[nseg - 1].len : 0;
+    usize mapped = 0;
+    while (mapped < len) {
+        u8 *p = addr + mapped;
+        usize n = MIN(len - mapped, PAGE_SIZE - ((u64)p % PAGE_SIZE));
+        n = MIN(n, (usize)disk.size_max);
+        // memory right after the last segment on the same page extends it.
+        if (b->nseg > 0) {
+            auto s = &b->seg[b->nseg - 1];
+            if (s->addr + s->len == p && (u64)p % PAGE_SIZE != 0 &&
+                s->len + n <= disk.size_max) {
+                s->len += (u32)n;
+                mapped += n;
+                continue;
+            }
+        }
+        if (b->nseg == disk.seg_max) {
+            // out of segments: leave `b` as it was.
+            b->nseg = nseg;
+            if (nseg > 0)
+                b->seg[nseg - 1].len = last;
+            return false;
+        }
+        b->seg[b->nseg].addr = p;
+        b->seg[b->nseg].len = (u32)n;
+        b->nseg++;
+        mapped += n;
+    }
+    return true;
+}
+
+static void notify()
+{
+    arch_fence();
+    u16 idx = disk.virtq.avail->idx;
+    // the device tells us in avail_event which index it will look at next
+    // without being kicked.
+    if (!disk.event_idx ||
+        need_event(disk.virtq.used->avail_event, idx, disk.notified_idx)) {
+        REG(VIRTIO_REG_QUEUE_NOTIFY) = 0;
+        disk.stats.notifies++;
+    }
+    disk.notified_idx = idx;
+    arch_fence();
+}
+
+void virtio_blk_submit(BlkReq **reqs, int n)
+{
+    int queued = 0;
+    acquire_spinlock(&disk.lk);
+    for (int i = 0; i < n; i++) {
+        BlkReq *b = reqs[i];
+        init_sem(&b->sem, 0);
+        ASSERT(b->nseg > 0 && b->nseg <= disk.seg_max);
+        while (disk.virtq.nfree < req_nring(b)) {
+            // ring is full: let the device drain what we have published so
+            // far, then sleep until the interrupt handler frees descriptors.
+            if (queued) {
+                notify();
+                queued = 0;
+            }
+            disk.nwaiting++;
+            release_spinlock(&disk.lk);
+            unalertable_wait_sem(&disk.free_sem);
+            acquire_spinlock(&disk.lk);
+        }
+        queue_req(b);
+        queued++;
+    }
+    arm_used_event();
+    if (queued)
+        notify();
+    disk.stats.requests += (u64)n;
     release_spinlock(&disk.lk);
+}
+
+// the post is the only sign of completion: the waiter may free `b` as soon
+// as it wakes, so the interrupt handler touches nothing after posting.
+void virtio_blk_wait(BlkReq *b)
+{
+    unalertable_wait_sem(&b->sem);
+}
+
+void virtio_blk_rw_req(BlkReq *r)
+{
+    r->end_io = NULL;
+    virtio_blk_submit(&r, 1);
+    virtio_blk_wait(r);
+}
+
+int virtio_blk_rw(Buf *b)
+{
+    BlkReq r;
+    r.flags = b->flags;
+    r.block_no = b->block_no;
+    virtio_blk_map(&r, b->data, BSIZE);
+    virtio_blk_rw_req(&r);
+    b->flags = r.flags;
     return 0;
 }
 
@@ -136,26 +314,49 @@ static void virtio_blk_intr()
 
     u32 intr_status = REG(VIRTIO_REG_INTERRUPT_STATUS);
     REG(VIRTIO_REG_INTERRUPT_ACK) = intr_status & 0x3;
+    disk.stats.interrupts++;
 
     int d0;
-    while (disk.virtq.last_used_idx != disk.virtq.used->idx) {
-        d0 = disk.virtq.used->ring[disk.virtq.last_used_idx % NQUEUE].id;
-        if (disk.virtq.info[d0].status != 0) {
-            PANIC();
+    do {
+        while (disk.virtq.last_used_idx != disk.virtq.used->idx) {
+            arch_fence();
+            d0 = disk.virtq.used->ring[disk.virtq.last_used_idx % NQUEUE].id;
+            if (disk.virtq.info[d0].status != 0) {
+                PANIC();
+            }
+
+            BlkReq *b = disk.virtq.info[d0].req;
+            disk.virtq.info[d0].req = NULL;
+            free_desc(&disk.virtq, d0);
+            disk.inflight--;
+            disk.stats.completions++;
+            if (disk.nwaiting > 0) {
+                disk.nwaiting--;
+                post_sem(&disk.free_sem);
+            }
+
+            if (b->flags & B_DIRTY)
+                b->flags &= ~B_DIRTY;
+            b->flags |= B_VALID;
+            if (b->end_io)
+                b->end_io(b);
+            else
+                post_sem(&b->sem);
+
+            disk.virtq.last_used_idx++;
         }
+        // entries used after we stopped looking may not raise another
+        // interrupt, so look again once the new event index is visible.
+        arm_used_event();
+    } while (disk.event_idx && disk.virtq.last_used_idx != disk.virtq.used->idx);
 
-        /* LAB 4 TODO 2 BEGIN */
-        disk.virtq.info[d0].done = 1;
-        int d1=disk.virtq.desc[d0].next;
-        auto data_ptr=P2V(disk.virtq.desc[d1].addr);
-        Buf* buf=(Buf*)(data_ptr-offset_of(Buf,data));
-        post_sem(&buf->sem);
-        /* LAB 4 TODO 2 END */
-
-        disk.virtq.info[d0].buf = NULL;
-        disk.virtq.last_used_idx++;
-    }
+    release_spinlock(&disk.lk);
+}
 
+void virtio_blk_stats(VirtioBlkStats *stats)
+{
+    acquire_spinlock(&disk.lk);
+    *stats = disk.stats;
     release_spinlock(&disk.lk);
 }
 
@@ -206,16 +407,12 @@ void virtio_init()
     REG(VIRTIO_REG_DRIVER_FEATURES_SEL) = 0;
 
     u32 features = REG(VIRTIO_REG_DEVICE_FEATURES);
-    features &= ~(1 << VIRTIO_BLK_F_SEG_MAX);
     features &= ~(1 << VIRTIO_BLK_F_GEOMETRY);
     features &= ~(1 << VIRTIO_BLK_F_RO);
-    features &= ~(1 << VIRTIO_BLK_F_BLK_SIZE);
     features &= ~(1 << VIRTIO_BLK_F_FLUSH);
     features &= ~(1 << VIRTIO_BLK_F_TOPOLOGY);
     features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
     features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-    features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
-    features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
     REG(VIRTIO_REG_DRIVER_FEATURES) = features;
 
     status |= DEV_STATUS_FEATURES_OK;
@@ -228,6 +425,26 @@ void virtio_init()
         PANIC();
     }
 
+    disk.indirect = features & (1 << VIRTIO_RING_F_INDIRECT_DESC);
+    disk.event_idx = features & (1 << VIRTIO_RING_F_EVENT_IDX);
+    disk.seg_max = MIN(BUF_MAX_SEG, NQUEUE - 2);
+    if (features & (1 << VIRTIO_BLK_F_SEG_MAX))
+        disk.seg_max = MIN(disk.seg_max, REG(VIRTIO_BLK_CFG_SEG_MAX));
+    if (disk.seg_max == 0)
+        disk.seg_max = 1;
+    disk.size_max = PAGE_SIZE;
+    if (features & (1 << VIRTIO_BLK_F_SIZE_MAX))
+        disk.size_max = MIN(disk.size_max, REG(VIRTIO_BLK_CFG_SIZE_MAX));
+    disk.blk_size = BSIZE;
+    if (features & (1 << VIRTIO_BLK_F_BLK_SIZE))
+        disk.blk_size = REG(VIRTIO_BLK_CFG_BLK_SIZE);
+    // single-sector requests must stay valid.
+    if (disk.blk_size == 0 || BSIZE % disk.blk_size != 0 ||
+        disk.size_max < disk.blk_size) {
+        printk("[Virtio]: Unsupported block size.");
+        PANIC();
+    }
+
     virtq_init(&disk.virtq);
 
     int qmax = REG(VIRTIO_REG_QUEUE_NUM_MAX);
@@ -261,4 +478,5 @@ void virtio_init()
 
     set_interrupt_handler(VIRTIO_BLK_IRQ, virtio_blk_intr);
     init_spinlock(&disk.lk);
+    init_sem(&disk.free_sem, 0);
 }
@@ -2,6 +2,19 @@
 #include <fs/block_device.h>
 #include <common/string.h>
 #include <kernel/printk.h>
+#include <kernel/mem.h>
+
+/**
+    @brief transfer one block. the device works on `buffer` in place, so there
+    is neither a bounce copy nor a payload on the stack.
+ */
+static void sd_rw(usize block_no, u8 *buffer, bool write) {
+    BlkReq r;
+    r.block_no = (u32)block_no;
+    r.flags = write ? (B_DIRTY | B_VALID) : 0;
+    virtio_blk_map(&r, buffer, BLOCK_SIZE);
+    virtio_blk_rw_req(&r);
+}
 
 /**
     @brief a simple implementation of reading a block from SD card.
@@ -10,11 +23,7 @@
     @param[out] buffer the buffer to store the data
  */
 static void sd_read(usize block_no, u8 *buffer) {
-    Buf b;
-    b.block_no = (u32)block_no;
-    b.flags = 0;
-    virtio_blk_rw(&b);
-    memcpy(buffer, b.data, BLOCK_SIZE);
+    sd_rw(block_no, buffer, false);
 }
 
 /**
@@ -24,11 +33,124 @@ static void sd_read(usize block_no, u8 *buffer) {
     @param[in] buffer the buffer to store the data
  */
 static void sd_write(usize block_no, u8 *buffer) {
-    Buf b;
-    b.block_no = (u32)block_no;
-    b.flags = B_DIRTY | B_VALID;
-    memcpy(b.data, buffer, BLOCK_SIZE);
-    virtio_blk_rw(&b);
+    sd_rw(block_no, buffer, true);
+}
+
+// requests in flight per round, one page of request descriptors.
+#define SD_BATCH ((int)(PAGE_SIZE / sizeof(BlkReq)))
+
+// submit `reqs[0..m)` together and wait for all of them.
+static void sd_submit_wait(BlkReq *reqs, int m) {
+    BlkReq *ptrs[SD_BATCH];
+    for (int j = 0; j < m; j++) {
+        reqs[j].end_io = NULL;
+        ptrs[j] = &reqs[j];
+    }
+    virtio_blk_submit(ptrs, m);
+    for (int j = 0; j < m; j++)
+        virtio_blk_wait(&reqs[j]);
+}
+
+/**
+    @brief submit a batch of block requests with one device notification and
+    wait for all of them. a block that follows the previous one on disk is
+    added to its request, so a contiguous run goes out as one multi-sector
+    scatter-gather request.
+ */
+static void sd_rw_batch(usize n, const usize *block_no, u8 *const *buffers,
+                        bool write) {
+    BlkReq *reqs = kalloc_page();
+    int m = 0;
+    usize next = 0;
+    for (usize i = 0; i < n; i++) {
+        if (m > 0 && block_no[i] == next &&
+            virtio_blk_map_more(&reqs[m - 1], buffers[i], BLOCK_SIZE)) {
+            next++;
+            continue;
+        }
+        reqs[m].block_no = (u32)block_no[i];
+        reqs[m].flags = write ? (B_DIRTY | B_VALID) : 0;
+        reqs[m].nseg = 0;
+        if (!virtio_blk_map_more(&reqs[m], buffers[i], BLOCK_SIZE))
+            PANIC();
+        next = block_no[i] + 1;
+        if (++m == SD_BATCH) {
+            sd_submit_wait(reqs, m);
+            m = 0;
+        }
+    }
+    if (m)
+        sd_submit_wait(reqs, m);
+    kfree_page(reqs);
+}
+
+static void sd_read_batch(usize n, const usize *block_no, u8 *const *buffers) {
+    sd_rw_batch(n, block_no, buffers, false);
+}
+
+static void sd_write_batch(usize n, const usize *block_no,
+                           u8 *const *buffers) {
+    sd_rw_batch(n, block_no, buffers, true);
+}
+
+// a request that nobody waits for, freed by its completion. it carries a
+// run of contiguous blocks, each with its own `done` argument.
+typedef struct {
+    BlkReq req;
+    void (*done)(void *arg);
+    int n;
+    void *arg[BUF_MAX_SEG];
+} SdAsync;
+
+static void sd_async_end(BlkReq *r) {
+    SdAsync *a = r->private;
+    for (int i = 0; i < a->n; i++)
+        a->done(a->arg[i]);
+    kfree(a);
+}
+
+/**
+    @brief hand `n` reads to the device with one notification per round and
+    return at once. contiguous runs share a request as in `sd_rw_batch`.
+    completions are reported through `done`.
+ */
+static void sd_read_async(usize n, const usize *block_no, u8 *const *buffers,
+                          void (*done)(void *arg), void *const *arg) {
+    BlkReq *ptrs[SD_BATCH];
+    int m = 0;
+    SdAsync *a = NULL;
+    usize next = 0;
+    for (usize i = 0; i < n; i++) {
+        if (a != NULL && block_no[i] == next && a->n < BUF_MAX_SEG &&
+            virtio_blk_map_more(&a->req, buffers[i], BLOCK_SIZE)) {
+            a->arg[a->n++] = arg[i];
+            next++;
+            continue;
+        }
+        if (a != NULL) {
+            ptrs[m] = &a->req;
+            if (++m == SD_BATCH) {
+                virtio_blk_submit(ptrs, m);
+                m = 0;
+            }
+        }
+        a = kalloc(sizeof(SdAsync));
+        a->done = done;
+        a->n = 1;
+        a->arg[0] = arg[i];
+        a->req.block_no = (u32)block_no[i];
+        a->req.flags = 0;
+        a->req.end_io = sd_async_end;
+        a->req.private = a;
+        a->req.nseg = 0;
+        if (!virtio_blk_map_more(&a->req, buffers[i], BLOCK_SIZE))
+            PANIC();
+        next = block_no[i] + 1;
+    }
+    if (a != NULL)
+        ptrs[m++] = &a->req;
+    if (m)
+        virtio_blk_submit(ptrs, m);
 }
 
 /**
@@ -58,6 +180,9 @@ void init_block_device() {
     sd_read(lba+1, sblock_data);
     block_device.read = sd_read;
     block_device.write = sd_write;
+    block_device.read_batch = sd_read_batch;
+    block_device.write_batch = sd_write_batch;
+    block_device.read_async = sd_read_async;
 
     const SuperBlock* sb = get_super_block();
 	printk("num_blocks: %d\n",sb->num_blocks);
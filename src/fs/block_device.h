@@ -29,6 +29,30 @@ typedef struct {
         @param[in] buffer the buffer to write from.
      */
     void (*write)(usize block_no, u8 *buffer);
+
+    /**
+        read `n` blocks at once: block `block_no[i]` goes to `buffers[i]`.
+        all requests are handed to the device together and the call returns
+        when every one of them has completed. runs of contiguous blocks in
+        `block_no` may be merged into multi-sector requests. may be NULL, in
+        which case the caller falls back to `read`.
+     */
+    void (*read_batch)(usize n, const usize *block_no, u8 *const *buffers);
+
+    /**
+        write `n` blocks at once: `buffers[i]` goes to block `block_no[i]`.
+        same rules as `read_batch`.
+     */
+    void (*write_batch)(usize n, const usize *block_no, u8 *const *buffers);
+
+    /**
+        start reading `n` blocks without waiting for them: block `block_no[i]`
+        goes to `buffers[i]`, and `done(arg[i])` runs in interrupt context
+        once it has arrived. may be NULL, in which case nothing can be read
+        ahead.
+     */
+    void (*read_async)(usize n, const usize *block_no, u8 *const *buffers,
+                       void (*done)(void *arg), void *const *arg);
 } BlockDevice;
 
 /**
@@ -23,24 +23,37 @@ static const SuperBlock *sblock;
 static const BlockDevice *device; 
 
 /**
-    @brief global lock for block cache.
+    @brief a hash bucket of cached blocks, keyed by `block_no`.
 
-    Use it to protect anything you need.
-
-    e.g. the list of allocated blocks, etc.
+    Lookups only take the lock of one bucket, so different blocks can be
+    acquired and released in parallel.
  */
-static SpinLock lock;
+static struct {
+    SpinLock lock;
+    ListNode head;
+} buckets[BCACHE_NUM_BUCKETS];
 
 /**
-    @brief the list of all allocated in-memory block.
+    @brief the lock of the CLOCK ring, the clock hand and `block_num`.
 
-    We use a linked list to manage all allocated cached blocks.
+    Lock order: clock_lock before the lock of any bucket.
+ */
+static SpinLock clock_lock;
 
-    You can implement your own data structure if you like better performance.
+/**
+    @brief the ring of all frames, swept by the CLOCK hand on eviction.
+ */
+static ListNode clock_ring;
+static ListNode *clock_hand;
+static usize num_frames;
 
-    @see Block
+/**
+    @brief the preallocated frames. More are `kalloc`ed only when all of them
+    are acquired or pinned.
  */
-static ListNode head;
+static Block frames[EVICTION_THRESHOLD];
+
+static BlockCacheStats stats;
 
 static LogHeader header; // in-memory copy of log header block.
 
@@ -64,33 +77,77 @@ struct {
     int outstanding;
     Semaphore sem;
     Semaphore check;
+
+    // group-commit mode, i.e. the checkpoint thread is running.
+    bool async;
+    // the checkpoint thread is installing `ckpt`. the log area can't be
+    // reused for the next group until it is done.
+    bool checkpointing;
+    // a committer is waiting on `ckpt_done`.
+    bool ckpt_waiting;
+    Semaphore ckpt_start;
+    Semaphore ckpt_done;
+    // the committed group that is being checkpointed.
+    LogHeader ckpt;
+
+    // staging for batched device writes. commits and checkpoints never
+    // overlap, so one set is enough.
+    Block *io_blocks[LOG_MAX_SIZE];
+    usize io_block_no[LOG_MAX_SIZE];
+    u8 *io_data[LOG_MAX_SIZE];
 } log;
 
+// an empty log header, written to disk after a checkpoint.
+static LogHeader empty_header;
+
+// the file system partition starts at this sector of the disk.
+#ifndef FS_PARTITION_START
+#define FS_PARTITION_START 0x20800
+#endif
+
+// the disk sector of file system block `block_no`.
+static INLINE usize disk_no(usize block_no) {
+    return block_no + FS_PARTITION_START;
+}
+
 // read the content from disk.
 static INLINE void device_read(Block *block) {
-    device->read(block->block_no+0x20800, block->data);
+    device->read(disk_no(block->block_no), block->data);
 }
 
 // write the content back to disk.
 static INLINE void device_write(Block *block) {
-    device->write(block->block_no+0x20800, block->data);
+    device->write(disk_no(block->block_no), block->data);
 }
 
 // read log header from disk.
 static INLINE void read_header() {
-    device->read(sblock->log_start+0x20800, (u8 *)&header);
+    device->read(disk_no(sblock->log_start), (u8 *)&header);
 }
 
 // write log header back to disk.
 static INLINE void write_header() {
-    device->write(sblock->log_start+0x20800, (u8 *)&header);
+    device->write(disk_no(sblock->log_start), (u8 *)&header);
+}
+
+// write the `n` blocks staged in `log.io_block_no`/`log.io_data`, as a
+// single batch if the device supports it.
+static void device_write_batch(usize n) {
+    if(device->write_batch){
+        device->write_batch(n,log.io_block_no,log.io_data);
+        return;
+    }
+    for(usize i=0;i<n;i++)device->write(log.io_block_no[i],log.io_data[i]);
 }
 
 // initialize a block struct.
 static void init_block(Block *block) {
     block->block_no = 0;
     init_list_node(&block->node);
-    block->acquired = false;
+    init_list_node(&block->clock);
+    block->cached = false;
+    block->referenced = false;
+    block->refcnt = 0;
     block->pinned = false;
 
     init_sleeplock(&block->lock);
@@ -106,84 +163,301 @@ static usize get_num_cached_blocks() {
 }
 
 // see `cache.h`.
-static Block *cache_acquire(usize block_no) {
-    // TODO
-    acquire_spinlock(&lock);
-    Block* res=NULL;
-    _for_in_list(p,&head){
-        if(p==&head)break;
-        Block* b=container_of(p,Block,node);
-        if(b->block_no==block_no){
-            res=b;
+static void get_stats(BlockCacheStats *_stats) {
+    _stats->hits = __atomic_load_n(&stats.hits, __ATOMIC_RELAXED);
+    _stats->misses = __atomic_load_n(&stats.misses, __ATOMIC_RELAXED);
+    _stats->evictions = __atomic_load_n(&stats.evictions, __ATOMIC_RELAXED);
+    _stats->prefetches = __atomic_load_n(&stats.prefetches, __ATOMIC_RELAXED);
+}
+
+static INLINE usize bucket_of(usize block_no) {
+    return block_no % BCACHE_NUM_BUCKETS;
+}
+
+// find `block_no` in its bucket. call with the lock of the bucket.
+static Block *bucket_lookup(usize block_no) {
+    auto bkt = &buckets[bucket_of(block_no)];
+    _for_in_list(p, &bkt->head) {
+        if (p == &bkt->head)
             break;
-        }
+        Block *b = container_of(p, Block, node);
+        if (b->block_no == block_no)
+            return b;
     }
-    if(res){
-        res->acquired=true;
-        release_spinlock(&lock);
-        if(!wait_sem(&res->lock))PANIC();
-        acquire_spinlock(&lock);
-        _detach_from_list(&res->node);
-        _insert_into_list(&head,&res->node);
-        release_spinlock(&lock);
-        return res;
-    }
-    if(block_num>=EVICTION_THRESHOLD){
-        for(ListNode* p=head.prev;p!=&head;p=p->prev){
-            if(block_num<EVICTION_THRESHOLD)break;
-            Block* b=container_of(p,Block,node);
-            if(!b->acquired&&!b->pinned){
-                ListNode* q=p;
-                p=p->next;
-                _detach_from_list(q);
-                block_num--;
-                kfree(b);
+    return NULL;
+}
+
+// take a frame for `block_no`: a free one while below capacity, otherwise
+// the first unused block the CLOCK hand finds without its reference bit.
+// the frame is returned with `refcnt == 1` so that nobody evicts it before
+// the caller inserts it into a bucket.
+static Block *get_frame(usize block_no) {
+    acquire_spinlock(&clock_lock);
+    Block *res = NULL;
+    // two rounds: the first one may only clear reference bits.
+    for (usize i = 0; !res && i < 2 * (num_frames + 1); i++) {
+        clock_hand = clock_hand->next;
+        if (clock_hand == &clock_ring)
+            continue;
+        Block *b = container_of(clock_hand, Block, clock);
+        if (!b->cached) {
+            block_num++;
+            res = b;
+            break;
+        }
+        if (block_num < EVICTION_THRESHOLD)
+            continue;
+        auto bkt = &buckets[bucket_of(b->block_no)];
+        acquire_spinlock(&bkt->lock);
+        if (b->refcnt == 0 && !b->pinned) {
+            if (b->referenced)
+                b->referenced = false;
+            else {
+                _detach_from_list(&b->node);
+                __atomic_fetch_add(&stats.evictions, 1, __ATOMIC_RELAXED);
+                res = b;
             }
         }
+        release_spinlock(&bkt->lock);
+    }
+    if (!res) {
+        res = kalloc(sizeof(Block));
+        init_block(res);
+        _insert_into_list(clock_hand, &res->clock);
+        num_frames++;
+        block_num++;
     }
-    res=kalloc(sizeof(Block));
-    init_block(res);
+    res->block_no = block_no;
+    res->cached = true;
+    res->referenced = false;
+    res->refcnt = 1;
+    release_spinlock(&clock_lock);
+    return res;
+}
 
-    res->block_no=block_no;
-    res->acquired=true;
-    res->valid=true;
+// give back a frame from `get_frame` that was not inserted into a bucket.
+static void put_frame(Block *frame) {
+    acquire_spinlock(&clock_lock);
+    auto bkt = &buckets[bucket_of(frame->block_no)];
+    acquire_spinlock(&bkt->lock);
+    frame->refcnt = 0;
+    release_spinlock(&bkt->lock);
+    frame->cached = false;
+    block_num--;
+    release_spinlock(&clock_lock);
+}
 
-    release_spinlock(&lock);
-    if(!wait_sem(&res->lock))PANIC();
-    device_read(res);
-    acquire_spinlock(&lock);
+// find or install the frame of `block_no` and lock it. a frame that was
+// just installed has `valid == false`, and the caller must fill it.
+static Block *acquire_frame(usize block_no) {
+    auto bkt = &buckets[bucket_of(block_no)];
+    acquire_spinlock(&bkt->lock);
+    Block *res = bucket_lookup(block_no);
+    if (res) {
+        res->refcnt++;
+        res->referenced = true;
+        release_spinlock(&bkt->lock);
+        __atomic_fetch_add(&stats.hits, 1, __ATOMIC_RELAXED);
+        if (!wait_sem(&res->lock))
+            PANIC();
+        return res;
+    }
+    release_spinlock(&bkt->lock);
+
+    Block *frame = get_frame(block_no);
+    acquire_spinlock(&bkt->lock);
+    res = bucket_lookup(block_no);
+    if (res) {
+        // someone else loaded it while we were looking for a frame.
+        res->refcnt++;
+        res->referenced = true;
+        release_spinlock(&bkt->lock);
+        put_frame(frame);
+        __atomic_fetch_add(&stats.hits, 1, __ATOMIC_RELAXED);
+        if (!wait_sem(&res->lock))
+            PANIC();
+        return res;
+    }
+    // nobody else can see the frame yet, so this never sleeps.
+    if (!get_sem(&frame->lock))
+        PANIC();
+    frame->valid = false;
+    _insert_into_list(&bkt->head, &frame->node);
+    release_spinlock(&bkt->lock);
+    __atomic_fetch_add(&stats.misses, 1, __ATOMIC_RELAXED);
+    return frame;
+}
 
-    block_num++;
-    _insert_into_list(&head,&res->node);
-    release_spinlock(&lock);
+// see `cache.h`.
+static Block *cache_acquire(usize block_no) {
+    // TODO
+    Block *res = acquire_frame(block_no);
+    if (!res->valid) {
+        device_read(res);
+        res->valid = true;
+    }
     return res;
 }
 
+// see `cache.h`.
+static void cache_acquire_batch(usize n, const usize *block_no, Block **blocks) {
+    usize io_block_no[CACHE_MAX_BATCH];
+    u8 *io_data[CACHE_MAX_BATCH];
+    usize m = 0;
+    ASSERT(n <= CACHE_MAX_BATCH);
+    for (usize i = 0; i < n; i++) {
+        blocks[i] = acquire_frame(block_no[i]);
+        if (!blocks[i]->valid) {
+            io_block_no[m] = disk_no(block_no[i]);
+            io_data[m++] = blocks[i]->data;
+        }
+    }
+    if (m == 0)
+        return;
+    if (device->read_batch)
+        device->read_batch(m, io_block_no, io_data);
+    else {
+        for (usize i = 0; i < m; i++)
+            device->read(io_block_no[i], io_data[i]);
+    }
+    for (usize i = 0; i < n; i++)
+        blocks[i]->valid = true;
+}
+
 // see `cache.h`.
 static void cache_release(Block *block) {
     // TODO
-    acquire_spinlock(&lock);
-    block->acquired=false;
+    auto bkt = &buckets[bucket_of(block->block_no)];
     post_sem(&block->lock);
-    release_spinlock(&lock);
+    acquire_spinlock(&bkt->lock);
+    block->refcnt--;
+    release_spinlock(&bkt->lock);
+}
+
+// a prefetched block has arrived. runs in interrupt context.
+static void prefetch_done(void *arg) {
+    Block *block = arg;
+    block->valid = true;
+    cache_release(block);
+}
+
+// see `cache.h`.
+static void cache_prefetch(usize n, const usize *block_no) {
+    usize io_block_no[CACHE_MAX_BATCH];
+    u8 *io_data[CACHE_MAX_BATCH];
+    void *io_arg[CACHE_MAX_BATCH];
+    usize m = 0;
+    if (!device->read_async)
+        return;
+    ASSERT(n <= CACHE_MAX_BATCH);
+    for (usize i = 0; i < n; i++) {
+        auto bkt = &buckets[bucket_of(block_no[i])];
+        acquire_spinlock(&bkt->lock);
+        Block *res = bucket_lookup(block_no[i]);
+        release_spinlock(&bkt->lock);
+        if (res)
+            continue;
+
+        Block *frame = get_frame(block_no[i]);
+        acquire_spinlock(&bkt->lock);
+        if (bucket_lookup(block_no[i])) {
+            release_spinlock(&bkt->lock);
+            put_frame(frame);
+            continue;
+        }
+        // the frame stays locked and referenced until its read completes,
+        // so readers wait for it and it is never evicted half-filled.
+        if (!get_sem(&frame->lock))
+            PANIC();
+        frame->valid = false;
+        _insert_into_list(&bkt->head, &frame->node);
+        release_spinlock(&bkt->lock);
+        __atomic_fetch_add(&stats.prefetches, 1, __ATOMIC_RELAXED);
+
+        io_block_no[m] = disk_no(block_no[i]);
+        io_data[m] = frame->data;
+        io_arg[m++] = frame;
+    }
+    if (m)
+        device->read_async(m, io_block_no, io_data, prefetch_done, io_arg);
 }
 
 SpinLock bitmap_lock;
 
+/**
+    @brief the in-memory summary of free blocks, built by `init_bcache` and
+    kept up to date by `alloc` and `free` under `bitmap_lock`.
+
+    Bitmap blocks without a free bit are skipped without being read.
+ */
+static struct {
+    usize num_bitmap_blocks;
+    u32 free_count[BCACHE_MAX_BITMAP_BLOCKS]; // free bits of each bitmap block.
+    usize cursor; // next fit: where a search without a goal starts.
+} fmap;
+
+// the first clear bit in `[from, limit)` of `bitmap`, or -1. looks at a
+// whole cell at a time.
+static isize find_free(BitmapCell *bitmap, usize from, usize limit) {
+    for (usize i = from / BITMAP_BITS_PER_CELL; i * BITMAP_BITS_PER_CELL < limit; i++) {
+        BitmapCell cell = ~bitmap[i];
+        if (i == from / BITMAP_BITS_PER_CELL)
+            cell &= ~(BitmapCell)0 << (from % BITMAP_BITS_PER_CELL);
+        if (cell == 0)
+            continue;
+        usize index = i * BITMAP_BITS_PER_CELL + (usize)__builtin_ctzll(cell);
+        return index < limit ? (isize)index : -1;
+    }
+    return -1;
+}
+
+// count the free blocks of every bitmap block into `fmap`. reads the disk
+// directly, so mounting leaves the cache and its statistics alone.
+static void build_fmap() {
+    fmap.num_bitmap_blocks = (sblock->num_blocks + BIT_PER_BLOCK - 1) / BIT_PER_BLOCK;
+    ASSERT(fmap.num_bitmap_blocks <= BCACHE_MAX_BITMAP_BLOCKS);
+    fmap.cursor = 0;
+    for (usize b = 0; b < fmap.num_bitmap_blocks; b++) {
+        usize limit = MIN((usize)BIT_PER_BLOCK, sblock->num_blocks - b * BIT_PER_BLOCK);
+        BitmapCell bitmap[BLOCK_SIZE / sizeof(BitmapCell)];
+        device->read(disk_no(sblock->bitmap_start+b), (u8 *)bitmap);
+        usize used = 0;
+        for (usize i = 0; i < limit / BITMAP_BITS_PER_CELL; i++)
+            used += (usize)__builtin_popcountll(bitmap[i]);
+        for (usize i = limit / BITMAP_BITS_PER_CELL * BITMAP_BITS_PER_CELL; i < limit; i++)
+            used += bitmap_get(bitmap, i);
+        fmap.free_count[b] = (u32)(limit - used);
+    }
+}
+
 // see `cache.h`.
 void init_bcache(const SuperBlock *_sblock, const BlockDevice *_device) {
     sblock = _sblock;
     device = _device;
 
     // TODO
-    init_spinlock(&lock);
+    for (int i = 0; i < BCACHE_NUM_BUCKETS; i++) {
+        init_spinlock(&buckets[i].lock);
+        init_list_node(&buckets[i].head);
+    }
+    init_spinlock(&clock_lock);
+    init_list_node(&clock_ring);
+    for (int i = 0; i < EVICTION_THRESHOLD; i++) {
+        init_block(&frames[i]);
+        _insert_into_list(&clock_ring, &frames[i].clock);
+    }
+    clock_hand = &clock_ring;
+    num_frames = EVICTION_THRESHOLD;
+    block_num=0;
+    memset(&stats, 0, sizeof(stats));
     init_spinlock(&log.lock);
     init_spinlock(&bitmap_lock);
-    init_list_node(&head);
-    block_num=0;
     log.outstanding=log.iscommit=0;
+    log.async=log.checkpointing=log.ckpt_waiting=0;
     init_sem(&log.sem,0);
     init_sem(&log.check,0);
+    init_sem(&log.ckpt_start,0);
+    init_sem(&log.ckpt_done,0);
     read_header();
     for(usize i=0;i<header.num_blocks;i++){
         Block* from=cache_acquire(sblock->log_start+i+1);
@@ -196,6 +470,7 @@ void init_bcache(const SuperBlock *_sblock, const BlockDevice *_device) {
     header.num_blocks=0;
     memset(header.block_no,0,LOG_MAX_SIZE);
     write_header();
+    build_fmap();
 }
 
 // see `cache.h`.
@@ -233,6 +508,34 @@ static void cache_sync(OpContext *ctx, Block *block) {
     release_spinlock(&log.lock);
 }
 
+// install the committed group in `log.ckpt` to the home locations from
+// its copies in the log area, then clear the log on disk.
+static void checkpoint() {
+    usize n=log.ckpt.num_blocks;
+    for(usize i=0;i<n;i++){
+        Block* from=cache_acquire(sblock->log_start+i+1);
+        log.io_blocks[i]=from;
+        log.io_block_no[i]=disk_no(log.ckpt.block_no[i]);
+        log.io_data[i]=from->data;
+    }
+    device_write_batch(n);
+    for(usize i=0;i<n;i++){
+        cache_release(log.io_blocks[i]);
+
+        // the running group may have logged it again, keep it pinned then.
+        Block* b=cache_acquire(log.ckpt.block_no[i]);
+        acquire_spinlock(&log.lock);
+        bool relogged=false;
+        for(usize j=0;j<header.num_blocks;j++){
+            if(header.block_no[j]==b->block_no)relogged=true;
+        }
+        if(!relogged)b->pinned=false;
+        release_spinlock(&log.lock);
+        cache_release(b);
+    }
+    device->write(disk_no(sblock->log_start),(u8 *)&empty_header);
+}
+
 // see `cache.h`.
 static void cache_end_op(OpContext *ctx) {
     // TODO
@@ -246,31 +549,42 @@ static void cache_end_op(OpContext *ctx) {
         return;
     }
     log.iscommit=1;
-    for(usize i=0;i<header.num_blocks;i++){
+    while(log.checkpointing){
+        log.ckpt_waiting=1;
         release_spinlock(&log.lock);
-
+        unalertable_wait_sem(&log.ckpt_done);
+        acquire_spinlock(&log.lock);
+    }
+    // no op is running, so the header is stable until we reset it.
+    usize n=header.num_blocks;
+    release_spinlock(&log.lock);
+    for(usize i=0;i<n;i++){
         Block* from=cache_acquire(header.block_no[i]);
         Block* to=cache_acquire(sblock->log_start+i+1);
         memcpy(to->data,from->data,BLOCK_SIZE);
-        device_write(to);
         cache_release(from);
-        cache_release(to);
-
-        acquire_spinlock(&log.lock);
+        log.io_blocks[i]=to;
+        log.io_block_no[i]=disk_no(to->block_no);
+        log.io_data[i]=to->data;
     }
-    release_spinlock(&log.lock);
+    // the whole group goes to the log area in one batch.
+    device_write_batch(n);
+    for(usize i=0;i<n;i++)cache_release(log.io_blocks[i]);
+    // the commit point of the whole group.
     write_header();
     acquire_spinlock(&log.lock);
-    for(usize i=0;i<header.num_blocks;i++){
-        Block* b=cache_acquire(header.block_no[i]);
-        device_write(b);
-        b->pinned=false;
-        cache_release(b);
-    }
+    memcpy(&log.ckpt,&header,sizeof(LogHeader));
     header.num_blocks=0;
-    release_spinlock(&log.lock);
-    write_header();
-    acquire_spinlock(&log.lock);
+    if(log.async){
+        // let the next group start while the checkpoint thread installs
+        // this one.
+        log.checkpointing=1;
+        post_sem(&log.ckpt_start);
+    }else{
+        release_spinlock(&log.lock);
+        checkpoint();
+        acquire_spinlock(&log.lock);
+    }
     log.iscommit=0;
     post_all_sem(&log.sem);
     post_all_sem(&log.check);
@@ -278,51 +592,98 @@ static void cache_end_op(OpContext *ctx) {
 }
 
 // see `cache.h`.
-static usize cache_alloc(OpContext *ctx) {
-    // TODO
+NO_RETURN void bcache_checkpointer(u64 arg) {
+    (void)arg;
+    acquire_spinlock(&log.lock);
+    log.async=1;
+    release_spinlock(&log.lock);
+    while(1){
+        unalertable_wait_sem(&log.ckpt_start);
+        checkpoint();
+        acquire_spinlock(&log.lock);
+        log.checkpointing=0;
+        if(log.ckpt_waiting){
+            log.ckpt_waiting=0;
+            post_sem(&log.ckpt_done);
+        }
+        release_spinlock(&log.lock);
+    }
+}
+
+// see `cache.h`.
+static usize cache_alloc_near(OpContext *ctx, usize goal) {
     acquire_spinlock(&bitmap_lock);
-    for (u32 block_head=0;block_head<sblock->num_blocks;block_head+=8*BLOCK_SIZE){
-        Block* block=cache_acquire(sblock->bitmap_start+block_head/(8*BLOCK_SIZE));
-        BitmapCell* bitmap=(BitmapCell*)block->data;
-        for (u32 index=0;index<(8*BLOCK_SIZE)&&block_head+index<sblock->num_blocks;index++){
-            if(bitmap_get(bitmap,index))continue;
-            bitmap_set(bitmap,index);
-            cache_sync(ctx,block);
+    usize start = goal > 0 && goal < sblock->num_blocks ? goal : fmap.cursor;
+    usize first = start / BIT_PER_BLOCK;
+    // the block of `start` comes twice: from `start` on, then once more
+    // from its beginning after wrapping around.
+    for (usize k = 0; k <= fmap.num_bitmap_blocks; k++) {
+        usize b = (first + k) % fmap.num_bitmap_blocks;
+        if (fmap.free_count[b] == 0)
+            continue;
+        usize from = k == 0 ? start % BIT_PER_BLOCK : 0;
+        usize limit = MIN((usize)BIT_PER_BLOCK, sblock->num_blocks - b * BIT_PER_BLOCK);
+        Block *block = cache_acquire(sblock->bitmap_start + b);
+        isize index = find_free((BitmapCell *)block->data, from, limit);
+        if (index < 0) {
             cache_release(block);
-
-            Block* res=cache_acquire(block_head+index);
-            memset(res->data,0,BLOCK_SIZE);
-            cache_sync(ctx,res);
-            cache_release(res);
-            release_spinlock(&bitmap_lock);
-            return block_head+index;
+            continue;
         }
+        bitmap_set((BitmapCell *)block->data, index);
+        cache_sync(ctx, block);
         cache_release(block);
+        fmap.free_count[b]--;
+        usize block_no = b * BIT_PER_BLOCK + index;
+        fmap.cursor = block_no + 1 < sblock->num_blocks ? block_no + 1 : 0;
+        release_spinlock(&bitmap_lock);
+
+        // nobody else knows about the block yet.
+        Block *res = cache_acquire(block_no);
+        memset(res->data, 0, BLOCK_SIZE);
+        cache_sync(ctx, res);
+        cache_release(res);
+        return block_no;
     }
     release_spinlock(&bitmap_lock);
     PANIC();
 }
 
+// see `cache.h`.
+static usize cache_alloc(OpContext *ctx) {
+    // TODO
+    return cache_alloc_near(ctx, 0);
+}
+
 // see `cache.h`.
 
 static void cache_free(OpContext *ctx, usize block_no) {
     // TODO
+    if (block_no >= sblock->num_blocks)
+        return;
     acquire_spinlock(&bitmap_lock);
-    Block* b=cache_acquire(sblock->bitmap_start+block_no/(8*BLOCK_SIZE));
-    usize index=block_no%(8*BLOCK_SIZE);
-    bitmap_clear((BitmapCell*)b->data,index);
-    cache_sync(ctx,b);
-    cache_release(b);
+    usize b = block_no / BIT_PER_BLOCK;
+    Block* block=cache_acquire(sblock->bitmap_start+b);
+    usize index=block_no%BIT_PER_BLOCK;
+    if (bitmap_get((BitmapCell*)block->data,index)) {
+        bitmap_clear((BitmapCell*)block->data,index);
+        cache_sync(ctx,block);
+        fmap.free_count[b]++;
+    }
+    cache_release(block);
     release_spinlock(&bitmap_lock);
 }
 
 BlockCache bcache = {
     .get_num_cached_blocks = get_num_cached_blocks,
+    .get_stats = get_stats,
     .acquire = cache_acquire,
+    .acquire_batch = cache_acquire_batch,
+    .prefetch = cache_prefetch,
     .release = cache_release,
     .begin_op = cache_begin_op,
     .sync = cache_sync,
     .end_op = cache_end_op,
     .alloc = cache_alloc,
+    .alloc_near = cache_alloc_near,
     .free = cache_free,
 };
\ No newline at end of file
@@ -10,12 +10,34 @@
 #define OP_MAX_NUM_BLOCKS 10
 
 /**
-    @brief the threshold of block cache to start eviction.
+    @brief the capacity of block cache, i.e. the number of preallocated frames.
 
-    if the number of cached blocks is no less than this threshold, we can
-    evict some blocks in `acquire` to keep block cache small.
+    if the number of cached blocks is no less than this threshold, `acquire`
+    evicts an unused block with the CLOCK policy and reuses its frame. The
+    cache only grows beyond it when every cached block is acquired or pinned.
+
+    @note define it at compile time to change the capacity.
+ */
+#ifndef EVICTION_THRESHOLD
+#define EVICTION_THRESHOLD 512
+#endif
+
+/**
+    @brief the number of hash buckets of block cache. Each bucket has its own
+    lock.
+ */
+#define BCACHE_NUM_BUCKETS 64
+
+/**
+    @brief maximum number of blocks that one `acquire_batch` can take.
  */
-#define EVICTION_THRESHOLD 20
+#define CACHE_MAX_BATCH 16
+
+/**
+    @brief maximum number of bitmap blocks, i.e. the file system holds at most
+    `BCACHE_MAX_BITMAP_BLOCKS * BIT_PER_BLOCK` blocks.
+ */
+#define BCACHE_MAX_BITMAP_BLOCKS 64
 
 /**
     @brief a block in block cache.
@@ -33,18 +55,41 @@ typedef struct {
     usize block_no;
 
     /**
-        @brief list this block into a linked list.
+        @brief list this block into its hash bucket.
 
-        @note should be protected by the global lock of the block cache.
+        @note should be protected by the lock of the bucket.
      */
     ListNode node;
 
     /**
-        @brief is the block already acquired by some thread or process?
+        @brief list this block into the CLOCK ring of all frames.
 
-        @note should be protected by the global lock of the block cache.
+        @note should be protected by the clock lock of the block cache.
      */
-    bool acquired;
+    ListNode clock;
+
+    /**
+        @brief does this frame hold a block, i.e. is it in a bucket or about
+        to be inserted into one?
+
+        @note should be protected by the clock lock of the block cache.
+     */
+    bool cached;
+
+    /**
+        @brief the CLOCK reference bit, set on every hit.
+     */
+    bool referenced;
+
+    /**
+        @brief how many threads or processes acquired or are waiting for
+        this block?
+
+        A block with non-zero `refcnt` should not be evicted from the cache.
+
+        @note should be protected by the lock of the bucket.
+     */
+    usize refcnt;
 
     /**
         @brief is the block pinned?
@@ -53,7 +98,7 @@ typedef struct {
 
         e.g. it is dirty.
 
-        @note should be protected by the global lock of the block cache.
+        @note only changed while the block is acquired.
      */
     bool pinned;
 
@@ -107,6 +152,18 @@ typedef struct {
 } OpContext;
 
 
+/**
+    @brief statistics of block cache.
+
+    @see BlockCache.get_stats
+ */
+typedef struct {
+    usize hits;
+    usize misses;
+    usize evictions;
+    usize prefetches; // blocks queued by `prefetch`.
+} BlockCacheStats;
+
 typedef struct {
     /**
         @return the number of cached blocks at this moment.
@@ -115,6 +172,11 @@ typedef struct {
      */
     usize (*get_num_cached_blocks)();
 
+    /**
+        @brief copy the hit, miss and eviction counters into `stats`.
+     */
+    void (*get_stats)(BlockCacheStats *stats);
+
     /**
         @brief declare a block as acquired by the caller.
 
@@ -127,6 +189,28 @@ typedef struct {
      */
     Block *(*acquire)(usize block_no);
 
+    /**
+        @brief acquire `n` distinct blocks at once: `blocks[i]` is the locked
+        block of `block_no[i]`.
+
+        The blocks that are not cached are read from disk as one batch
+        instead of one request each. `n` is at most `CACHE_MAX_BATCH`.
+
+        @note the caller must `release` every one of them, and must not
+        hold any of them already.
+     */
+    void (*acquire_batch)(usize n, const usize *block_no, Block **blocks);
+
+    /**
+        @brief start reading the blocks of `block_no[0..n)` that are not
+        cached, without waiting for them. `n` is at most `CACHE_MAX_BATCH`.
+
+        A block being prefetched is already in the cache: `acquire` on it
+        sleeps until it has arrived instead of reading it again. Does
+        nothing if the device cannot read asynchronously.
+     */
+    void (*prefetch)(usize n, const usize *block_no);
+
     /**
         @brief declare an acquired block as released by the caller.
 
@@ -218,6 +302,13 @@ typedef struct {
      */
     usize (*alloc)(OpContext *ctx);
 
+    /**
+        @brief like `alloc`, but try `goal` first and then the blocks after
+        it, so that a file written sequentially gets contiguous blocks.
+        `goal == 0` means no preference.
+     */
+    usize (*alloc_near)(OpContext *ctx, usize goal);
+
     /**
         @brief free the block at `block_no` in bitmap.
 
@@ -252,4 +343,16 @@ extern BlockCache bcache;
 
     @note You may want to put it into `*_init` method groups.
  */
-void init_bcache(const SuperBlock *sblock, const BlockDevice *device);
\ No newline at end of file
+void init_bcache(const SuperBlock *sblock, const BlockDevice *device);
+
+/**
+    @brief the body of the background checkpoint thread.
+
+    Once it is running, the log works in group-commit mode: all operations
+    that end together share one commit, `end_op` returns as soon as the
+    commit record is on disk, and this thread writes the logged blocks to
+    their home locations. Without it, `end_op` checkpoints by itself.
+
+    @note start it after `init_bcache`.
+ */
+NO_RETURN void bcache_checkpointer(u64 arg);
\ No newline at end of file
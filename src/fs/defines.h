@@ -14,7 +14,9 @@
 #define INODE_NUM_DIRECT 12
 #define INODE_NUM_INDIRECT (BLOCK_SIZE / sizeof(u32))
 #define INODE_PER_BLOCK (BLOCK_SIZE / sizeof(InodeEntry))
-#define INODE_MAX_BLOCKS (INODE_NUM_DIRECT + INODE_NUM_INDIRECT)
+#define INODE_NUM_DINDIRECT (INODE_NUM_INDIRECT * INODE_NUM_INDIRECT)
+#define INODE_MAX_BLOCKS \
+    (INODE_NUM_DIRECT + INODE_NUM_INDIRECT + INODE_NUM_DINDIRECT)
 #define INODE_MAX_BYTES (INODE_MAX_BLOCKS * BLOCK_SIZE)
 
 // the maximum length of file names, including trailing '\0'.
@@ -50,15 +52,25 @@ typedef struct {
 // `type == INODE_INVALID` implies this inode is free.
 typedef struct dinode {
     InodeType type;
-    u16 major; // major device id, for INODE_DEVICE only.
-    u16 minor; // minor device id, for INODE_DEVICE only.
     u16 num_links; // number of hard links to this inode in the filesystem.
+    union {
+        struct {
+            u16 major; // major device id for INODE_DEVICE; for
+                       // INODE_DIRECTORY, the number of hash buckets of an
+                       // indexed directory, 0 if linear.
+            u16 minor; // minor device id, for INODE_DEVICE only.
+        };
+        // the double indirect block, for INODE_REGULAR only. so only regular
+        // files grow past `INODE_NUM_DIRECT + INODE_NUM_INDIRECT` blocks.
+        u32 dindirect;
+    };
     u32 num_bytes; // number of bytes in the file, i.e. the size of file.
     u32 addrs[INODE_NUM_DIRECT]; // direct addresses/block numbers.
     u32 indirect; // the indirect address block.
 } InodeEntry;
 
-// the block pointed by `InodeEntry.indirect`.
+// the block pointed by `InodeEntry.indirect`, and the blocks pointed by
+// `InodeEntry.dindirect` and by its entries.
 typedef struct {
     u32 addrs[INODE_NUM_INDIRECT];
 } IndirectBlock;
@@ -69,10 +81,31 @@ typedef struct dirent {
     char name[FILE_NAME_MAX_LENGTH];
 } DirEntry;
 
+#define DIR_PER_BLOCK (BLOCK_SIZE / sizeof(DirEntry))
+
+// indexed directories:
+//
+// the first `major` blocks of the directory are hash buckets. an entry goes
+// to the first free slot of bucket `dir_hash(name) % major`, or of the
+// buckets after it. a free slot with an empty name was never used, so a
+// bucket that has one ends the probe. when every bucket is full, entries are
+// appended after the buckets as in a linear directory.
+//
+// free slots are ordinary free entries, so the directory still reads as a
+// (sparse) linear one.
+static INLINE u32 dir_hash(const char *name) {
+    u32 h = 2166136261u; // FNV-1a
+    for (int i = 0; i < FILE_NAME_MAX_LENGTH && name[i]; i++) {
+        h ^= (u8)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
 typedef struct {
     usize num_blocks;
     usize block_no[LOG_MAX_SIZE];
 } LogHeader;
 
 // mkfs only
-#define FSSIZE 1000 // Size of file system in blocks
\ No newline at end of file
+#define FSSIZE 40000 // Size of file system in blocks
\ No newline at end of file
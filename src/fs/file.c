@@ -28,6 +28,9 @@ struct file* file_alloc() {
     for(int i=0;i<NFILE;i++){
         if(ftable.files[i].ref==0){
             ftable.files[i].ref=1;
+            ftable.files[i].ra_next=0;
+            ftable.files[i].ra_end=0;
+            ftable.files[i].ra_window=0;
             release_spinlock(&ftable.lock);
             return &(ftable.files[i]);
         }
@@ -83,6 +86,26 @@ int file_stat(struct file* f, struct stat* st) {
     return -1;
 }
 
+// keep the blocks after a sequential read of `n` bytes of `f` in flight.
+// the window doubles each time it is used and is dropped on a seek.
+// call with the lock of `f->ip`.
+static void file_readahead(struct file* f, usize n) {
+    if(f->off!=f->ra_next){
+        f->ra_window=0;
+        f->ra_end=0;
+        return;
+    }
+    if(f->ra_window==0)f->ra_window=FILE_RA_MIN;
+    usize end=f->off+n;
+    // the next window goes out once the reader is within half a window of
+    // what is already in flight.
+    if(end+f->ra_window/2<f->ra_end)return;
+    usize start=MAX(f->ra_end,f->off);
+    inodes.readahead(f->ip,start,end+f->ra_window-start);
+    f->ra_end=end+f->ra_window;
+    f->ra_window=MIN(f->ra_window*2,(usize)FILE_RA_MAX);
+}
+
 /* Read from file f. */
 isize file_read(struct file* f, char* addr, isize n) {
     /* (Final) TODO BEGIN */
@@ -90,9 +113,12 @@ isize file_read(struct file* f, char* addr, isize n) {
     if(f->readable==0)return -1;
     if(f->type==FD_PIPE)return pipe_read(f->pipe,(u64)addr,n);
     if(f->type==FD_INODE){
+        IoVec iov={(u8*)addr,n};
         inodes.lock(f->ip);
-        auto res=inodes.read(f->ip,(u8*)addr,f->off,n);
+        file_readahead(f,n);
+        auto res=inodes.readv(f->ip,&iov,1,f->off);
         if(res>0)f->off+=res;
+        f->ra_next=f->off;
         inodes.unlock(f->ip);
         return res;
     }
@@ -111,10 +137,11 @@ isize file_write(struct file* f, char* addr, isize n) {
         isize idx=0;
         while (idx<n){
             isize len=MIN(n-idx,maxbytes);
+            IoVec iov={(u8*)(addr+idx),len};
             OpContext ctx;
             bcache.begin_op(&ctx);
             inodes.lock(f->ip);
-            isize reallen=inodes.write(&ctx,f->ip,(u8*)(addr+idx),f->off,len);
+            isize reallen=inodes.writev(&ctx,f->ip,&iov,1,f->off);
             if (reallen>0) f->off+=reallen;
             inodes.unlock(f->ip);
             bcache.end_op(&ctx);
@@ -11,6 +11,11 @@
 // maximum number of open files in the whole system.
 #define NFILE 65536  
 
+// the readahead window grows from FILE_RA_MIN to FILE_RA_MAX bytes while a
+// file is read sequentially.
+#define FILE_RA_MIN (4 * BLOCK_SIZE)
+#define FILE_RA_MAX (64 * BLOCK_SIZE)
+
 typedef struct file {
     // type of the file.
     // Note that a device file will be FD_INODE too.
@@ -27,6 +32,10 @@ typedef struct file {
     // offset of the file in bytes.
     // For a pipe, it is the number of bytes that have been written/read.
     usize off;
+    // sequential readahead, for inodes only. `ra_next` is where the next
+    // read starts if the access is sequential, `ra_end` is how far blocks
+    // have been prefetched, and `ra_window` is the current window in bytes.
+    usize ra_next, ra_end, ra_window;
 } File;
 
 struct ftable {
@@ -6,12 +6,14 @@
 #include <fs/file.h>
 #include <common/defines.h>
 #include <kernel/printk.h>
+#include <kernel/proc.h>
 
 void init_filesystem() {
     init_block_device();
 
     const SuperBlock* sblock = get_super_block();
     init_bcache(sblock, &block_device);
+    start_proc(create_proc(), bcache_checkpointer, 0);
     init_inodes(sblock, &bcache);
     init_ftable();
 }
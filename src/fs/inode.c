@@ -1,3 +1,4 @@
+#include <common/bitmap.h>
 #include <common/string.h>
 #include <fs/inode.h>
 #include <kernel/mem.h>
@@ -24,27 +25,79 @@ static const SuperBlock* sblock;
 static const BlockCache* cache;
 
 /**
-    @brief global lock for inode layer.
+    @brief the hash table of all in-memory inodes, keyed by `inode_no`.
 
-    Use it to protect anything you need.
+    Each bucket has its own lock, which protects the chain and the `rc`
+    of the inodes on it. Lock order: bucket lock before `lru_lock`.
 
-    e.g. the list of allocated blocks, ref counts, etc.
+    @see Inode
  */
-static SpinLock lock;
+static struct {
+    SpinLock lock;
+    ListNode head;
+} buckets[INODE_NUM_BUCKETS];
 
 /**
-    @brief the list of all allocated in-memory inodes.
+    @brief unreferenced inodes that are kept for reuse, least recently put
+    first.
+ */
+static SpinLock lru_lock;
+static ListNode lru_list;
+static usize lru_count;
 
-    We use a linked list to manage all allocated inodes.
+/**
+    @brief an entry of the directory entry cache: `name` in directory `parent`
+    is `inode_no` at byte `index` of the directory, or does not exist if
+    `inode_no` is 0.
 
-    You can implement your own data structure if you want better performance.
+    Entries of a directory only change under the lock of that directory, in
+    `lookup`, `insert`, `remove` and `clear`.
+ */
+typedef struct {
+    ListNode node; // hash chain.
+    ListNode lru;
+    usize parent;
+    usize inode_no;
+    usize index;
+    char name[FILE_NAME_MAX_LENGTH];
+} Dentry;
 
-    @see Inode
+static struct {
+    SpinLock lock;
+    ListNode buckets[DCACHE_NUM_BUCKETS];
+    // every entry is on it, unused ones (`parent == 0`) first.
+    ListNode lru;
+    Dentry entries[DCACHE_SIZE];
+    DcacheStats stats;
+} dcache;
+
+
+/**
+    @brief the page cache.
+
+    Pages are found through a hash of (inode, index), every inode lists its
+    own pages so that they go away together, and all pages are on one LRU
+    for eviction beyond `PAGE_CACHE_MAX`. `lock` protects all of these and
+    `CachedPage.pins`, while the content of a page is only filled or changed
+    under the lock of its inode.
  */
-static ListNode head;
+static struct {
+    SpinLock lock;
+    ListNode buckets[PCACHE_NUM_BUCKETS];
+    ListNode lru;
+    usize count;
+    PageCacheStats stats;
+} pcache;
 
+/**
+    @brief the free-inode index: bit `i` is set iff inode `i` is free on disk.
+
+    Built by `init_inodes` with one pass over the inode blocks, so that
+    `alloc` finds a free inode without reading any block it does not take.
+ */
+static SpinLock ifree_lock;
+static Bitmap(ifree, INODE_MAX_NUM);
 
-// return which block `inode_no` lives on.
 static INLINE usize to_block_no(usize inode_no) {
     return sblock->inode_start + (inode_no / (INODE_PER_BLOCK));
 }
@@ -61,34 +114,244 @@ static INLINE u32* get_addrs(Block* block) {
 
 // initialize inode tree.
 void init_inodes(const SuperBlock* _sblock, const BlockCache* _cache) {
-    init_spinlock(&lock);
-    init_list_node(&head);
+    for (usize i = 0; i < INODE_NUM_BUCKETS; i++) {
+        init_spinlock(&buckets[i].lock);
+        init_list_node(&buckets[i].head);
+    }
+    init_spinlock(&lru_lock);
+    init_list_node(&lru_list);
+    lru_count = 0;
+    init_spinlock(&dcache.lock);
+    for (usize i = 0; i < DCACHE_NUM_BUCKETS; i++)
+        init_list_node(&dcache.buckets[i]);
+    init_list_node(&dcache.lru);
+    for (usize i = 0; i < DCACHE_SIZE; i++) {
+        memset(&dcache.entries[i], 0, sizeof(Dentry));
+        init_list_node(&dcache.entries[i].node);
+        _insert_into_list(dcache.lru.prev, &dcache.entries[i].lru);
+    }
+    memset(&dcache.stats, 0, sizeof(DcacheStats));
+    init_spinlock(&pcache.lock);
+    for (usize i = 0; i < PCACHE_NUM_BUCKETS; i++)
+        init_list_node(&pcache.buckets[i]);
+    init_list_node(&pcache.lru);
+    pcache.count = 0;
+    memset(&pcache.stats, 0, sizeof(PageCacheStats));
     sblock = _sblock;
     cache = _cache;
 
+    init_spinlock(&ifree_lock);
+    ASSERT(sblock->num_inodes <= INODE_MAX_NUM);
+    memset(ifree, 0, sizeof(ifree));
+    for (usize i = 1; i < sblock->num_inodes;) {
+        usize block_no = to_block_no(i);
+        Block* block = cache->acquire(block_no);
+        for (; i < sblock->num_inodes && to_block_no(i) == block_no; i++) {
+            if (get_entry(block, i)->type == INODE_INVALID)
+                bitmap_set(ifree, i);
+        }
+        cache->release(block);
+    }
+
     if (ROOT_INODE_NO < sblock->num_inodes)
         inodes.root = inodes.get(ROOT_INODE_NO);
     else
         printk("(warn) init_inodes: no root inode.\n");
 }
 
+// return the dcache bucket of `name` in `parent`.
+static usize dcache_bucket(usize parent, const char* name) {
+    usize h = parent;
+    for (usize i = 0; i < FILE_NAME_MAX_LENGTH && name[i]; i++)
+        h = h * 31 + (u8)name[i];
+    return h % DCACHE_NUM_BUCKETS;
+}
+
+// find `name` in `parent`. the caller must hold `dcache.lock`.
+static Dentry* dcache_find(usize parent, const char* name) {
+    ListNode* head = &dcache.buckets[dcache_bucket(parent, name)];
+    _for_in_list(p, head) {
+        if (p == head)
+            break;
+        auto d = container_of(p, Dentry, node);
+        if (d->parent == parent &&
+            strncmp(d->name, name, FILE_NAME_MAX_LENGTH) == 0)
+            return d;
+    }
+    return NULL;
+}
+
+// look `name` up in the dcache. on a hit, set `*inode_no` (0 for a negative
+// entry) and `*index` and return true.
+static bool dcache_lookup(usize parent,
+                          const char* name,
+                          usize* inode_no,
+                          usize* index) {
+    acquire_spinlock(&dcache.lock);
+    Dentry* d = dcache_find(parent, name);
+    if (d) {
+        *inode_no = d->inode_no;
+        *index = d->index;
+        _detach_from_list(&d->lru);
+        _insert_into_list(dcache.lru.prev, &d->lru);
+        if (d->inode_no)
+            dcache.stats.hits++;
+        else
+            dcache.stats.neg_hits++;
+    } else {
+        dcache.stats.misses++;
+    }
+    release_spinlock(&dcache.lock);
+    return d != NULL;
+}
+
+// record that `name` in `parent` is `inode_no` at `index`, or absent if
+// `inode_no` is 0. reuses the least recently used entry.
+static void dcache_add(usize parent,
+                       const char* name,
+                       usize inode_no,
+                       usize index) {
+    acquire_spinlock(&dcache.lock);
+    Dentry* d = dcache_find(parent, name);
+    if (!d) {
+        d = container_of(dcache.lru.next, Dentry, lru);
+        _detach_from_list(&d->node);
+        d->parent = parent;
+        strncpy(d->name, name, FILE_NAME_MAX_LENGTH);
+        _insert_into_list(&dcache.buckets[dcache_bucket(parent, name)],
+                          &d->node);
+    }
+    d->inode_no = inode_no;
+    d->index = index;
+    _detach_from_list(&d->lru);
+    _insert_into_list(dcache.lru.prev, &d->lru);
+    release_spinlock(&dcache.lock);
+}
+
+// forget every entry of directory `parent`.
+static void dcache_purge(usize parent) {
+    acquire_spinlock(&dcache.lock);
+    for (usize i = 0; i < DCACHE_SIZE; i++) {
+        Dentry* d = &dcache.entries[i];
+        if (d->parent != parent)
+            continue;
+        _detach_from_list(&d->node);
+        d->parent = 0;
+        _detach_from_list(&d->lru);
+        _insert_into_list(&dcache.lru, &d->lru);
+    }
+    release_spinlock(&dcache.lock);
+}
+
+// see `inode.h`.
+void get_dcache_stats(DcacheStats* stats) {
+    acquire_spinlock(&dcache.lock);
+    *stats = dcache.stats;
+    release_spinlock(&dcache.lock);
+}
+
+static INLINE usize pcache_bucket(Inode* inode, usize index) {
+    return ((usize)inode / sizeof(Inode) + index) % PCACHE_NUM_BUCKETS;
+}
+
+// find page `index` of `inode`. call with `pcache.lock`.
+static CachedPage* pcache_find(Inode* inode, usize index) {
+    ListNode* head = &pcache.buckets[pcache_bucket(inode, index)];
+    _for_in_list(p, head) {
+        if (p == head)
+            break;
+        CachedPage* page = container_of(p, CachedPage, node);
+        if (page->inode == inode && page->index == index)
+            return page;
+    }
+    return NULL;
+}
+
+// free an unpinned page. call with `pcache.lock`.
+static void pcache_free(CachedPage* page) {
+    ASSERT(page->pins == 0);
+    _detach_from_list(&page->node);
+    _detach_from_list(&page->lru);
+    _detach_from_list(&page->link);
+    pcache.count--;
+    kfree_page(page->data);
+    kfree(page);
+}
+
+// evict unpinned pages, least recently used first, down to
+// `PAGE_CACHE_MAX`. call with `pcache.lock`.
+static void pcache_shrink() {
+    ListNode* p = pcache.lru.prev;
+    while (pcache.count > PAGE_CACHE_MAX && p != &pcache.lru) {
+        CachedPage* page = container_of(p, CachedPage, lru);
+        p = p->prev;
+        if (page->pins > 0)
+            continue;
+        pcache_free(page);
+        pcache.stats.evictions++;
+    }
+}
+
+// drop all cached pages of `inode`, whose content is going away. nobody
+// else can pin them: the caller holds the lock of `inode`, or its last
+// reference is gone.
+static void pcache_drop(Inode* inode) {
+    acquire_spinlock(&pcache.lock);
+    while (!_empty_list(&inode->pages))
+        pcache_free(container_of(inode->pages.next, CachedPage, link));
+    release_spinlock(&pcache.lock);
+}
+
+// see `inode.h`.
+void get_page_cache_stats(PageCacheStats* stats) {
+    acquire_spinlock(&pcache.lock);
+    *stats = pcache.stats;
+    release_spinlock(&pcache.lock);
+}
+
 // initialize in-memory inode.
 static void init_inode(Inode* inode) {
     init_sleeplock(&inode->lock);
     init_rc(&inode->rc);
     init_list_node(&inode->node);
+    init_list_node(&inode->lru);
+    init_list_node(&inode->pages);
     inode->inode_no = 0;
     inode->valid = false;
 }
 
+// take a free inode from the index, looking from the inode block of `near`
+// on and wrapping around. return 0 if there is none.
+static usize take_free_inode(usize near) {
+    usize n=sblock->num_inodes;
+    usize ncells=BITMAP_TO_NUM_CELLS(n);
+    usize from=near/INODE_PER_BLOCK*INODE_PER_BLOCK;
+    if(from>=n)from=0;
+    usize first=from/BITMAP_BITS_PER_CELL;
+    acquire_spinlock(&ifree_lock);
+    // the first cell comes twice: from `from` on, then as a whole.
+    for(usize k=0;k<=ncells;k++){
+        usize c=(first+k)%ncells;
+        BitmapCell cell=ifree[c];
+        if(k==0)cell&=~(BitmapCell)0<<(from%BITMAP_BITS_PER_CELL);
+        if(cell==0)continue;
+        usize i=c*BITMAP_BITS_PER_CELL+(usize)__builtin_ctzll(cell);
+        bitmap_clear(ifree,i);
+        release_spinlock(&ifree_lock);
+        return i;
+    }
+    release_spinlock(&ifree_lock);
+    return 0;
+}
+
 // see `inode.h`.
-static usize inode_alloc(OpContext* ctx, InodeType type) {
+static usize inode_alloc_near(OpContext* ctx, InodeType type, usize near) {
     ASSERT(type != INODE_INVALID);
 
     // TODO
-    for(usize i=1;i<sblock->num_inodes;i++){
-        usize block_no=to_block_no(i);
-        Block* block=cache->acquire(block_no);
+    usize i;
+    while((i=take_free_inode(near))!=0){
+        Block* block=cache->acquire(to_block_no(i));
         InodeEntry* entry=get_entry(block,i);
 
         if(entry->type==INODE_INVALID){
@@ -98,11 +361,17 @@ static usize inode_alloc(OpContext* ctx, InodeType type) {
             cache->release(block);
             return i;
         }
+        // the index was wrong about it, and it stays taken.
         cache->release(block);
     }
     return 0;
 }
 
+// see `inode.h`.
+static usize inode_alloc(OpContext* ctx, InodeType type) {
+    return inode_alloc_near(ctx,type,ROOT_INODE_NO);
+}
+
 // see `inode.h`.
 static void inode_lock(Inode* inode) {
     ASSERT(inode->rc.count > 0);
@@ -133,44 +402,99 @@ static void inode_sync(OpContext* ctx, Inode* inode, bool do_write) {
     cache->release(block);
 }
 
+// return the bucket of `inode_no`.
+static INLINE usize bucket_of(usize inode_no) {
+    return inode_no % INODE_NUM_BUCKETS;
+}
+
+// find `inode_no` in bucket `b`. the caller must hold the bucket lock.
+static Inode* bucket_lookup(usize b, usize inode_no) {
+    _for_in_list(p, &buckets[b].head) {
+        if (p == &buckets[b].head)
+            break;
+        auto inode = container_of(p, Inode, node);
+        if (inode->inode_no == inode_no)
+            return inode;
+    }
+    return NULL;
+}
+
+// evict the oldest unreferenced inodes while the LRU is over its limit.
+static void lru_trim() {
+    acquire_spinlock(&lru_lock);
+    while (lru_count > INODE_LRU_MAX) {
+        auto inode = container_of(lru_list.next, Inode, lru);
+        // bucket locks come first, so only try it here; an inode we can't
+        // take now is trimmed by a later `put`.
+        usize b = bucket_of(inode->inode_no);
+        if (!try_acquire_spinlock(&buckets[b].lock))
+            break;
+        _detach_from_list(&inode->lru);
+        lru_count--;
+        _detach_from_list(&inode->node);
+        release_spinlock(&buckets[b].lock);
+        pcache_drop(inode);
+        kfree(inode);
+    }
+    release_spinlock(&lru_lock);
+}
+
 // see `inode.h`.
 static Inode* inode_get(usize inode_no) {
     ASSERT(inode_no > 0);
     ASSERT(inode_no < sblock->num_inodes);
-    acquire_spinlock(&lock);
-    // TODO
-    _for_in_list(p,&head){
-        if(p==&head)break;
-        auto inode=container_of(p,Inode,node);
-        if(inode->inode_no==inode_no){
-            increment_rc(&inode->rc);
-            release_spinlock(&lock);
-            return inode;
+    usize b = bucket_of(inode_no);
+    acquire_spinlock(&buckets[b].lock);
+    Inode* inode = bucket_lookup(b, inode_no);
+    if (inode) {
+        if (inode->rc.count == 0) {
+            acquire_spinlock(&lru_lock);
+            _detach_from_list(&inode->lru);
+            lru_count--;
+            release_spinlock(&lru_lock);
         }
+        increment_rc(&inode->rc);
+        release_spinlock(&buckets[b].lock);
+        return inode;
     }
 
-    Inode* inode=kalloc(sizeof(Inode));
+    inode = kalloc(sizeof(Inode));
     init_inode(inode);
-    inode->inode_no=inode_no;
+    inode->inode_no = inode_no;
     increment_rc(&inode->rc);
+    // publish it locked, so that others wait until it is loaded.
     inode_lock(inode);
-    inode_sync(NULL,inode,false);
+    _insert_into_list(&buckets[b].head, &inode->node);
+    release_spinlock(&buckets[b].lock);
+    inode_sync(NULL, inode, false);
     inode_unlock(inode);
-    _insert_into_list(&head,&inode->node);
-    release_spinlock(&lock);
     return inode;
 }
+// free the indirect block `block_no` and the blocks it points to. with
+// `depth == 2`, the entries are indirect blocks themselves.
+static void free_indirect(OpContext* ctx, usize block_no, int depth) {
+    Block* block=cache->acquire(block_no);
+    auto addrs=get_addrs(block);
+    for(usize i=0;i<INODE_NUM_INDIRECT;i++){
+        if(!addrs[i])continue;
+        if(depth>1)free_indirect(ctx,addrs[i],depth-1);
+        else cache->free(ctx,addrs[i]);
+    }
+    cache->release(block);
+    cache->free(ctx,block_no);
+}
+
 // see `inode.h`.
 static void inode_clear(OpContext* ctx, Inode* inode) {
     // TODO
+    dcache_purge(inode->inode_no);
+    pcache_drop(inode);
+    if(inode->entry.type==INODE_REGULAR&&inode->entry.dindirect!=0){
+        free_indirect(ctx,inode->entry.dindirect,2);
+        inode->entry.dindirect=0;
+    }
     if(inode->entry.indirect!=0){
-        Block* block=cache->acquire(inode->entry.indirect);
-        auto addrs=get_addrs(block);
-        for(usize i=0;i<INODE_NUM_INDIRECT;i++){
-            if(addrs[i])cache->free(ctx,addrs[i]);
-        }
-        cache->release(block);
-        cache->free(ctx,inode->entry.indirect);
+        free_indirect(ctx,inode->entry.indirect,1);
         inode->entry.indirect=0;
     }
     for(usize i=0;i<INODE_NUM_DIRECT;i++){
@@ -194,19 +518,131 @@ static Inode* inode_share(Inode* inode) {
 static void inode_put(OpContext* ctx, Inode* inode) {
     // TODO
     inode_lock(inode);
+    usize b = bucket_of(inode->inode_no);
+    acquire_spinlock(&buckets[b].lock);
     decrement_rc(&inode->rc);
-    if(inode->rc.count==0&&inode->entry.num_links==0){
-        inode->entry.type=INODE_INVALID;
-        inode_clear(ctx,inode);
-        inode_sync(ctx,inode,true);
-        acquire_spinlock(&lock);
+    if (inode->rc.count > 0) {
+        release_spinlock(&buckets[b].lock);
+        inode_unlock(inode);
+        return;
+    }
+    if (inode->entry.num_links == 0) {
+        // nobody can find it once it is off the bucket.
         _detach_from_list(&inode->node);
-        release_spinlock(&lock);
+        release_spinlock(&buckets[b].lock);
+        inode_clear(ctx, inode);
+        inode->entry.type = INODE_INVALID;
+        inode_sync(ctx, inode, true);
+        acquire_spinlock(&ifree_lock);
+        bitmap_set(ifree, inode->inode_no);
+        release_spinlock(&ifree_lock);
         post_sem(&inode->lock);
         kfree(inode);
         return;
     }
+    // still linked: keep it cached. it must be unlocked before it becomes
+    // visible to `lru_trim`.
     post_sem(&inode->lock);
+    acquire_spinlock(&lru_lock);
+    _insert_into_list(lru_list.prev, &inode->lru);
+    lru_count++;
+    release_spinlock(&lru_lock);
+    release_spinlock(&buckets[b].lock);
+    lru_trim();
+}
+
+// how many of `addrs[0..n)` continue the physical run starting at
+// `addrs[0]`.
+static INLINE usize run_length(const u32* addrs, usize n) {
+    usize k=1;
+    while(k<n&&addrs[k]!=0&&addrs[k]==addrs[0]+k)k++;
+    return k;
+}
+
+// map entry `index` of the indirect block in `*slot`, which lives in
+// `holder`, or in the inode if `holder` is NULL. new blocks are placed near
+// `goal`, or right after the previous entry. see `inode_map_run`.
+static usize map_indirect(OpContext* ctx,
+                          Inode* inode,
+                          Block* holder,
+                          u32* slot,
+                          usize index,
+                          usize goal,
+                          usize max,
+                          usize* run,
+                          bool* modified) {
+    if(*slot==0){
+        if(!ctx)return 0;
+        *slot=cache->alloc_near(ctx,goal);
+        if(goal)goal=*slot+1;
+        if(holder)cache->sync(ctx,holder);
+        else inode_sync(ctx,inode,true);
+    }
+    Block* block=cache->acquire(*slot);
+    auto addrs=get_addrs(block);
+    if(addrs[index]==0){
+        if(!ctx){
+            cache->release(block);
+            return 0;
+        }
+        if(modified)*modified=1;
+        if(index>0&&addrs[index-1])goal=addrs[index-1]+1;
+        addrs[index]=cache->alloc_near(ctx,goal);
+        cache->sync(ctx,block);
+    }
+    usize res=addrs[index];
+    if(run)*run=run_length(addrs+index,MIN(max,INODE_NUM_INDIRECT-index));
+    cache->release(block);
+    return res;
+}
+
+/**
+    @brief like `inode_map`, and also report in `run` how many blocks from
+    `offset` on, at most `max`, are physically contiguous, so that a whole
+    run can be resolved with one lookup.
+
+    Logical blocks go through the direct addresses, then the indirect block,
+    then the double indirect block (regular files only).
+ */
+static usize inode_map_run(OpContext* ctx,
+                           Inode* inode,
+                           usize offset,
+                           usize max,
+                           usize* run,
+                           bool* modified) {
+    InodeEntry* entry=&inode->entry;
+    if(run)*run=1;
+    if(offset<INODE_NUM_DIRECT){
+        if(entry->addrs[offset]==0){
+            if(!ctx)return 0;
+            if(modified)*modified=1;
+            usize goal=offset>0&&entry->addrs[offset-1]?entry->addrs[offset-1]+1:0;
+            entry->addrs[offset]=cache->alloc_near(ctx,goal);
+            inode_sync(ctx,inode,true);
+        }
+        if(run)*run=run_length(entry->addrs+offset,MIN(max,INODE_NUM_DIRECT-offset));
+        return entry->addrs[offset];
+    }
+    offset-=INODE_NUM_DIRECT;
+    if(offset<INODE_NUM_INDIRECT){
+        usize last=entry->addrs[INODE_NUM_DIRECT-1];
+        return map_indirect(ctx,inode,NULL,&entry->indirect,offset,last?last+1:0,max,run,modified);
+    }
+    offset-=INODE_NUM_INDIRECT;
+    ASSERT(offset<INODE_NUM_DINDIRECT);
+    ASSERT(entry->type==INODE_REGULAR);
+    if(entry->dindirect==0){
+        if(!ctx)return 0;
+        entry->dindirect=cache->alloc_near(ctx,entry->indirect?entry->indirect+1:0);
+        inode_sync(ctx,inode,true);
+    }
+    Block* outer=cache->acquire(entry->dindirect);
+    u32* slot=get_addrs(outer)+offset/INODE_NUM_INDIRECT;
+    usize goal=entry->dindirect+1;
+    if(offset>=INODE_NUM_INDIRECT&&slot[-1])goal=slot[-1]+1;
+    usize res=map_indirect(ctx,inode,outer,slot,offset%INODE_NUM_INDIRECT,goal,max,run,modified);
+    cache->release(outer);
+    return res;
 }
 
 /**
@@ -236,36 +672,170 @@ static usize inode_map(OpContext* ctx,
                        usize offset,
                        bool* modified) {
     // TODO
-    if(offset<INODE_NUM_DIRECT){
-        if(inode->entry.addrs[offset]==0){
-            if(modified)*modified=1;
-            inode->entry.addrs[offset]=cache->alloc(ctx);
-            inode_sync(ctx,inode,true);
+    return inode_map_run(ctx,inode,offset,1,NULL,modified);
+}
+
+// copy `len` bytes between `data` and `iov`, from buffer `*v` at `*voff`
+// on, and advance the position. `from_iov` tells the direction.
+static void iov_copy(const IoVec* iov,
+                     usize* v,
+                     usize* voff,
+                     u8* data,
+                     usize len,
+                     bool from_iov) {
+    while(len>0){
+        while(*voff==iov[*v].len){(*v)++;*voff=0;}
+        usize n=MIN(len,iov[*v].len-*voff);
+        // a mapping writing its own page cache frame back copies nothing.
+        if(data!=(u8*)iov[*v].base+*voff){
+            if(from_iov)memcpy(data,iov[*v].base+*voff,n);
+            else memcpy(iov[*v].base+*voff,data,n);
         }
-        return inode->entry.addrs[offset];
+        data+=n;len-=n;*voff+=n;
     }
-    offset-=INODE_NUM_DIRECT;
-    if(inode->entry.indirect==0){
-        inode->entry.indirect=cache->alloc(ctx);
-        inode_sync(ctx,inode,1);
+}
+
+// advance the position in `iov` by `len` bytes without copying.
+static void iov_skip(const IoVec* iov,usize* v,usize* voff,usize len) {
+    while(len>0){
+        while(*voff==iov[*v].len){(*v)++;*voff=0;}
+        usize n=MIN(len,iov[*v].len-*voff);
+        len-=n;*voff+=n;
     }
-    Block* block=cache->acquire(inode->entry.indirect);
-    auto addrs=get_addrs(block);
-    if(addrs[offset]==0){
-        if(modified)*modified=1;
-        addrs[offset]=cache->alloc(ctx);
-        cache->sync(ctx,block);
+}
+
+// map the `n` blocks from `first` on into `block_no`, with one lookup per
+// contiguous run. see `inode_map_run`.
+static void map_batch(OpContext* ctx,
+                      Inode* inode,
+                      usize first,
+                      usize n,
+                      usize* block_no) {
+    for(usize i=0,run=0;i<n;i++,run--){
+        if(run==0)block_no[i]=inode_map_run(ctx,inode,first+i,n-i,&run,NULL);
+        else block_no[i]=block_no[i-1]+1;
+    }
+}
+
+/**
+    @brief copy between the bytes `[offset, offset + count)` of `inode` and
+    the buffers of `iov`, which hold at least `count` bytes.
+
+    The range goes in batches of at most `CACHE_MAX_BATCH` blocks: a batch
+    is mapped with one lookup per contiguous run, its blocks are acquired
+    together, so the missing ones are read in one go, and then copied in
+    bulk. When writing, missing blocks are allocated with `ctx`.
+ */
+static void inode_rw(OpContext* ctx,
+                     Inode* inode,
+                     const IoVec* iov,
+                     usize offset,
+                     usize count,
+                     bool write) {
+    usize block_no[CACHE_MAX_BATCH];
+    Block* blocks[CACHE_MAX_BATCH];
+    usize end=offset+count,v=0,voff=0;
+    for(usize first=offset/BLOCK_SIZE;first*BLOCK_SIZE<end;first+=CACHE_MAX_BATCH){
+        usize n=MIN((usize)CACHE_MAX_BATCH,(end-1)/BLOCK_SIZE+1-first);
+        map_batch(ctx,inode,first,n,block_no);
+        cache->acquire_batch(n,block_no,blocks);
+        for(usize i=0;i<n;i++){
+            usize l=MAX((first+i)*BLOCK_SIZE,offset);
+            usize r=MIN((first+i+1)*BLOCK_SIZE,end);
+            iov_copy(iov,&v,&voff,blocks[i]->data+l%BLOCK_SIZE,r-l,write);
+            if(write)cache->sync(ctx,blocks[i]);
+            cache->release(blocks[i]);
+        }
     }
-    usize res=addrs[offset];
-    cache->release(block);
-    return res;
 }
 
 // see `inode.h`.
-static usize inode_read(Inode* inode, u8* dest, usize offset, usize count) {
+static CachedPage* inode_get_page(Inode* inode, usize index) {
+    ASSERT(inode->entry.type==INODE_REGULAR);
+    acquire_spinlock(&pcache.lock);
+    CachedPage* page=pcache_find(inode,index);
+    if(page){
+        page->pins++;
+        _detach_from_list(&page->lru);
+        _insert_into_list(&pcache.lru,&page->lru);
+        pcache.stats.hits++;
+        release_spinlock(&pcache.lock);
+        return page;
+    }
+    pcache.stats.misses++;
+    release_spinlock(&pcache.lock);
+
+    // only the holder of the inode lock fills pages of it, so nobody can
+    // add this page while we are filling it.
+    page=kalloc(sizeof(CachedPage));
+    page->inode=inode;
+    page->index=index;
+    page->pins=1;
+    page->data=kalloc_page();
+    usize offset=index*PAGE_SIZE,n=0;
+    if(offset<inode->entry.num_bytes){
+        n=MIN((usize)PAGE_SIZE,inode->entry.num_bytes-offset);
+        IoVec iov={page->data,n};
+        inode_rw(NULL,inode,&iov,offset,n,false);
+    }
+    memset(page->data+n,0,PAGE_SIZE-n);
+
+    acquire_spinlock(&pcache.lock);
+    _insert_into_list(&pcache.buckets[pcache_bucket(inode,index)],&page->node);
+    _insert_into_list(&pcache.lru,&page->lru);
+    _insert_into_list(&inode->pages,&page->link);
+    pcache.count++;
+    pcache_shrink();
+    release_spinlock(&pcache.lock);
+    return page;
+}
+
+// see `inode.h`.
+static void inode_put_page(CachedPage* page) {
+    acquire_spinlock(&pcache.lock);
+    ASSERT(page->pins>0);
+    page->pins--;
+    release_spinlock(&pcache.lock);
+}
+
+// copy the bytes just written from `iov` to `[offset, offset + count)` of
+// `inode` into the pages of it that are cached.
+static void pcache_refresh(Inode* inode,
+                           const IoVec* iov,
+                           usize offset,
+                           usize count) {
+    usize end=offset+count,v=0,voff=0;
+    for(usize i=offset/PAGE_SIZE;i*PAGE_SIZE<end;i++){
+        usize l=MAX(i*PAGE_SIZE,offset),r=MIN((i+1)*PAGE_SIZE,end);
+        acquire_spinlock(&pcache.lock);
+        CachedPage* page=pcache_find(inode,i);
+        if(page)page->pins++;
+        release_spinlock(&pcache.lock);
+        if(!page){
+            iov_skip(iov,&v,&voff,r-l);
+            continue;
+        }
+        iov_copy(iov,&v,&voff,page->data+l%PAGE_SIZE,r-l,true);
+        inode_put_page(page);
+    }
+}
+
+// see `inode.h`.
+static usize inode_readv(Inode* inode,
+                         const IoVec* iov,
+                         usize iovcnt,
+                         usize offset) {
+    usize count=0;
     if(inode->entry.type==INODE_DEVICE){
-        return console_read(inode,(char*)dest,count);
+        for(usize i=0;i<iovcnt;i++){
+            isize n=console_read(inode,(char*)iov[i].base,iov[i].len);
+            if(n<=0)break;
+            count+=n;
+            if((usize)n<iov[i].len)break;
+        }
+        return count;
     }
+    for(usize i=0;i<iovcnt;i++)count+=iov[i].len;
 
     InodeEntry* entry = &inode->entry;
     if (count + offset > entry->num_bytes)
@@ -275,33 +845,38 @@ static usize inode_read(Inode* inode, u8* dest, usize offset, usize count) {
     ASSERT(end <= entry->num_bytes);
     ASSERT(offset <= end);
 
-    // TODO
-
-    // printk("inode_read %lld begin offset:%lld count:%lld\n",inode->inode_no,offset,count);
-
-    for(usize i=offset/BLOCK_SIZE;i*BLOCK_SIZE<end;i++){   
-        usize l=i*BLOCK_SIZE;if(l<offset)l=offset;
-        usize r=(i+1)*BLOCK_SIZE;if(r>end)r=end;
-        usize len=r-l;
-
-        usize block_no=inode_map(NULL,inode,i,NULL);
-        Block* block=cache->acquire(block_no);
-        memcpy(dest,block->data+(l==offset?offset%BLOCK_SIZE:0),len);
-        dest+=len;
-        cache->release(block);
+    if(count==0)return 0;
+    if(entry->type!=INODE_REGULAR){
+        inode_rw(NULL,inode,iov,offset,count,false);
+        return count;
+    }
+    // regular files are read through the page cache.
+    usize v=0,voff=0;
+    for(usize i=offset/PAGE_SIZE;i*PAGE_SIZE<end;i++){
+        usize l=MAX(i*PAGE_SIZE,offset),r=MIN((i+1)*PAGE_SIZE,end);
+        CachedPage* page=inode_get_page(inode,i);
+        iov_copy(iov,&v,&voff,page->data+l%PAGE_SIZE,r-l,false);
+        inode_put_page(page);
     }
     return count;
 }
 
 // see `inode.h`.
-static usize inode_write(OpContext* ctx,
-                         Inode* inode,
-                         u8* src,
-                         usize offset,
-                         usize count) {
-    if (inode->entry.type == INODE_DEVICE) {
-        return console_write(inode, (char*)src, count);
+static usize inode_writev(OpContext* ctx,
+                          Inode* inode,
+                          const IoVec* iov,
+                          usize iovcnt,
+                          usize offset) {
+    usize count=0;
+    if(inode->entry.type==INODE_DEVICE){
+        for(usize i=0;i<iovcnt;i++){
+            isize n=console_write(inode,(char*)iov[i].base,iov[i].len);
+            if(n<=0)break;
+            count+=n;
+        }
+        return count;
     }
+    for(usize i=0;i<iovcnt;i++)count+=iov[i].len;
 
     InodeEntry* entry = &inode->entry;
     usize end = offset + count;
@@ -309,24 +884,123 @@ static usize inode_write(OpContext* ctx,
     ASSERT(end <= INODE_MAX_BYTES);
     ASSERT(offset <= end);
 
-    // TODO
+    if(count>0)inode_rw(ctx,inode,iov,offset,count,true);
+    // the size goes to disk once, after all the blocks are in place.
     if(entry->num_bytes<end){
         entry->num_bytes=end;
         inode_sync(ctx,inode,true);
     }
-    for(usize i=offset/BLOCK_SIZE;i*BLOCK_SIZE<end;i++){
-        usize l=i*BLOCK_SIZE;if(l<offset)l=offset;
-        usize r=(i+1)*BLOCK_SIZE;if(r>end)r=end;
-        usize len=r-l;
+    // writes go through to the log, and cached pages follow them.
+    if(count>0&&entry->type==INODE_REGULAR)pcache_refresh(inode,iov,offset,count);
+    return count;
+}
+
+// see `inode.h`.
+static void inode_readahead(Inode* inode, usize offset, usize count) {
+    InodeEntry* entry = &inode->entry;
+    if(entry->type==INODE_DEVICE||offset>=entry->num_bytes)return;
+    usize end=MIN(offset+count,(usize)entry->num_bytes);
+    usize block_no[CACHE_MAX_BATCH];
+    for(usize first=offset/BLOCK_SIZE;first*BLOCK_SIZE<end;first+=CACHE_MAX_BATCH){
+        usize n=MIN((usize)CACHE_MAX_BATCH,(end-1)/BLOCK_SIZE+1-first);
+        map_batch(NULL,inode,first,n,block_no);
+        // holes have nothing to read.
+        usize m=0;
+        for(usize i=0;i<n;i++)if(block_no[i])block_no[m++]=block_no[i];
+        if(m)cache->prefetch(m,block_no);
+    }
+}
 
-        usize block_no=inode_map(ctx,inode,i,NULL);
-        Block* block=cache->acquire(block_no);
-        memcpy(block->data+(l==offset?offset%BLOCK_SIZE:0),src,len);
-        src+=len;
-        cache->sync(ctx,block);
+// see `inode.h`.
+static usize inode_read(Inode* inode, u8* dest, usize offset, usize count) {
+    IoVec iov={dest,count};
+    return inode_readv(inode,&iov,1,offset);
+}
+
+// see `inode.h`.
+static usize inode_write(OpContext* ctx,
+                         Inode* inode,
+                         u8* src,
+                         usize offset,
+                         usize count) {
+    IoVec iov={src,count};
+    return inode_writev(ctx,inode,&iov,1,offset);
+}
+
+// the number of hash buckets of directory `inode`, or 0 if it is linear.
+// a cleared directory has lost its buckets and is linear again.
+static INLINE usize dir_buckets(Inode* inode) {
+    usize n = inode->entry.major;
+    if (n == 0 || inode->entry.num_bytes < n * BLOCK_SIZE)
+        return 0;
+    return n;
+}
+
+// scan directory entries in [begin, end) for `name`. on return, `*free` is
+// the first free slot seen if it was INODE_MAX_BYTES before.
+static usize dir_scan(Inode* inode,
+                      const char* name,
+                      usize begin,
+                      usize end,
+                      usize* index,
+                      usize* free) {
+    for (usize i = begin; i < end; i += sizeof(DirEntry)) {
+        DirEntry dir;
+        inode_read(inode, (u8*)&dir, i, sizeof(DirEntry));
+        if (dir.inode_no == 0) {
+            if (*free == INODE_MAX_BYTES)
+                *free = i;
+        } else if (strncmp(name, dir.name, FILE_NAME_MAX_LENGTH) == 0) {
+            *index = i;
+            return dir.inode_no;
+        }
+    }
+    return 0;
+}
+
+// look `name` up in the indexed directory `inode` with `n` buckets. see
+// `fs/defines.h` for the layout. `*free` is set as in `dir_scan`, and stays
+// INODE_MAX_BYTES if the entry should be appended.
+static usize dir_probe(Inode* inode,
+                       usize n,
+                       const char* name,
+                       usize* index,
+                       usize* free) {
+    usize home = dir_hash(name) % n;
+    for (usize k = 0; k < n; k++) {
+        usize b = (home + k) % n;
+        Block* block = cache->acquire(inode_map(NULL, inode, b, NULL));
+        DirEntry* dir = (DirEntry*)block->data;
+        bool end = false;
+        for (usize i = 0; i < DIR_PER_BLOCK; i++) {
+            if (dir[i].inode_no == 0) {
+                if (*free == INODE_MAX_BYTES)
+                    *free = b * BLOCK_SIZE + i * sizeof(DirEntry);
+                if (dir[i].name[0] == 0)
+                    end = true;
+            } else if (strncmp(name, dir[i].name, FILE_NAME_MAX_LENGTH) == 0) {
+                usize inode_no = dir[i].inode_no;
+                cache->release(block);
+                *index = b * BLOCK_SIZE + i * sizeof(DirEntry);
+                return inode_no;
+            }
+        }
         cache->release(block);
+        if (end)
+            return 0;
     }
-    return count;
+    // every bucket is full: the rest is linear.
+    return dir_scan(inode, name, n * BLOCK_SIZE, inode->entry.num_bytes, index,
+                    free);
+}
+
+// find `name` in directory `inode`, either layout.
+static usize dir_find(Inode* inode, const char* name, usize* index, usize* free) {
+    *free = INODE_MAX_BYTES;
+    usize n = dir_buckets(inode);
+    if (n)
+        return dir_probe(inode, n, name, index, free);
+    return dir_scan(inode, name, 0, inode->entry.num_bytes, index, free);
 }
 
 // see `inode.h`.
@@ -335,16 +1009,17 @@ static usize inode_lookup(Inode* inode, const char* name, usize* index) {
     ASSERT(entry->type == INODE_DIRECTORY);
 
     // TODO
-    auto name_len=strlen(name);
-    for(usize i=0;i<entry->num_bytes;i+=sizeof(DirEntry)){
-        DirEntry dir;
-        inode_read(inode,(u8*)&dir,i,sizeof(DirEntry));
-        if(dir.inode_no&&name_len==strlen(dir.name)&&strncmp(name,dir.name,name_len)==0){
-            if(index)*index=i;
-            return dir.inode_no;
-        }
+    usize inode_no, i, free;
+    if (dcache_lookup(inode->inode_no, name, &inode_no, &i)) {
+        if (inode_no && index)
+            *index = i;
+        return inode_no;
     }
-    return 0;
+    inode_no = dir_find(inode, name, &i, &free);
+    dcache_add(inode->inode_no, name, inode_no, inode_no ? i : 0);
+    if (inode_no && index)
+        *index = i;
+    return inode_no;
 }
 
 // see `inode.h`.
@@ -356,19 +1031,15 @@ static usize inode_insert(OpContext* ctx,
     ASSERT(entry->type == INODE_DIRECTORY);
 
     // TODO
-    usize index=INODE_MAX_BYTES;
-    auto name_len=strlen(name);
-    for(usize i=0;i<entry->num_bytes;i+=sizeof(DirEntry)){
-        DirEntry dir;
-        inode_read(inode,(u8*)&dir,i,sizeof(DirEntry));
-        if(dir.inode_no==0&&index==INODE_MAX_BYTES)index=i;
-        if(dir.inode_no&&name_len==strlen(dir.name)&&strncmp(name,dir.name,name_len)==0)return -1;
-    }
-    if(index==INODE_MAX_BYTES)index=entry->num_bytes;
+    usize index, free;
+    if (dir_find(inode, name, &index, &free) != 0)
+        return -1;
+    index = free == INODE_MAX_BYTES ? entry->num_bytes : free;
     DirEntry dir;
     strncpy(dir.name,name,FILE_NAME_MAX_LENGTH);
     dir.inode_no=inode_no;
     inode_write(ctx,inode,(u8*)&dir,index,sizeof(DirEntry));
+    dcache_add(inode->inode_no,name,inode_no,index);
     return index;
 }
 
@@ -377,12 +1048,18 @@ static void inode_remove(OpContext* ctx, Inode* inode, usize index) {
     // TODO
     DirEntry dir;
     inode_read(inode,(u8*)&dir,index,sizeof(DirEntry));
+    if(dir.inode_no==0)return;
     dir.inode_no=0;
     inode_write(ctx,inode,(u8*)&dir,index,sizeof(DirEntry));
+    char name[FILE_NAME_MAX_LENGTH+1];
+    strncpy(name,dir.name,FILE_NAME_MAX_LENGTH);
+    name[FILE_NAME_MAX_LENGTH]=0;
+    dcache_add(inode->inode_no,name,0,0);
 }
 
 InodeTree inodes = {
     .alloc = inode_alloc,
+    .alloc_near = inode_alloc_near,
     .lock = inode_lock,
     .unlock = inode_unlock,
     .sync = inode_sync,
@@ -392,6 +1069,11 @@ InodeTree inodes = {
     .put = inode_put,
     .read = inode_read,
     .write = inode_write,
+    .readv = inode_readv,
+    .writev = inode_writev,
+    .readahead = inode_readahead,
+    .get_page = inode_get_page,
+    .put_page = inode_put_page,
     .lookup = inode_lookup,
     .insert = inode_insert,
     .remove = inode_remove,
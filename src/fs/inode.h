@@ -1,4 +1,5 @@
 #pragma once
+#include <aarch64/mmu.h>
 #include <common/list.h>
 #include <common/rc.h>
 #include <common/spinlock.h>
@@ -11,6 +12,50 @@
  */
 #define ROOT_INODE_NO 1
 
+/**
+    @brief the number of hash buckets of the in-memory inode table.
+ */
+#define INODE_NUM_BUCKETS 64
+
+/**
+    @brief how many unreferenced but valid inodes are kept in memory.
+ */
+#ifndef INODE_LRU_MAX
+#define INODE_LRU_MAX 128
+#endif
+
+/**
+    @brief the number of entries of the directory entry cache.
+ */
+#ifndef DCACHE_SIZE
+#define DCACHE_SIZE 256
+#endif
+
+#define DCACHE_NUM_BUCKETS 64
+
+/**
+    @brief the most inodes the in-memory free-inode index can track.
+ */
+#define INODE_MAX_NUM 4096
+
+/**
+    @brief how many pages the page cache keeps before it evicts unpinned
+    ones.
+ */
+#ifndef PAGE_CACHE_MAX
+#define PAGE_CACHE_MAX 1024
+#endif
+
+#define PCACHE_NUM_BUCKETS 128
+
+/**
+    @brief one buffer of a vectored read or write.
+ */
+typedef struct {
+    u8* base;
+    usize len;
+} IoVec;
+
 /**
     @brief an inode in memory.
 
@@ -37,10 +82,23 @@ typedef struct {
     RefCount rc;
 
     /**
-        @brief link this inode into a linked list.
+        @brief link this inode into its hash bucket.
      */
     ListNode node;
 
+    /**
+        @brief link this inode into the LRU of unreferenced inodes, which
+        keeps it cached after the last `put` until it is reused or evicted.
+     */
+    ListNode lru;
+
+    /**
+        @brief the cached pages of this regular file.
+
+        @see CachedPage
+     */
+    ListNode pages;
+
     /**
         @brief the corresponding inode number on disk.
 
@@ -61,6 +119,44 @@ typedef struct {
     InodeEntry entry; 
 } Inode;
 
+/**
+    @brief a 4 KiB page of a regular file in the page cache.
+
+    `read`, `write` and mappings of the file all use the same frame `data`.
+    It holds bytes `[index * PAGE_SIZE, (index + 1) * PAGE_SIZE)` of the file,
+    and zeros past its end.
+
+    @see InodeTree.get_page
+ */
+typedef struct {
+    ListNode node; // hash chain.
+    ListNode lru;
+    ListNode link; // in `Inode.pages`.
+    Inode* inode;
+    usize index;
+    // a pinned page is never evicted.
+    usize pins;
+    u8* data;
+} CachedPage;
+
+/**
+    @brief counters of the directory entry cache.
+ */
+typedef struct {
+    usize hits;     // lookups answered with an inode.
+    usize neg_hits; // lookups answered with "no such entry".
+    usize misses;   // lookups that scanned the directory.
+} DcacheStats;
+
+/**
+    @brief counters of the page cache.
+ */
+typedef struct {
+    usize hits;
+    usize misses; // pages filled from the block cache.
+    usize evictions;
+} PageCacheStats;
+
 /**
     @brief interface of inode layer.
  */
@@ -83,6 +179,13 @@ typedef struct {
      */
     usize (*alloc)(OpContext* ctx, InodeType type);
 
+    /**
+        @brief like `alloc`, but prefer a free inode in the inode block of
+        `near`, or in the blocks after it. pass the parent directory so that
+        files of one directory share inode blocks.
+     */
+    usize (*alloc_near)(OpContext* ctx, InodeType type, usize near);
+
     /**
         @brief acquire the sleep lock of `inode`.
         
@@ -201,6 +304,59 @@ typedef struct {
                    usize offset,
                    usize count);
 
+    /**
+        @brief read from `inode`, beginning at `offset`, into the `iovcnt`
+        buffers of `iov` in order.
+
+        The whole range is mapped and its blocks are acquired in batches,
+        rather than one block at a time.
+
+        @return how many bytes you actually read.
+
+        @note caller must hold the lock of `inode`.
+     */
+    usize (*readv)(Inode* inode, const IoVec* iov, usize iovcnt, usize offset);
+
+    /**
+        @brief write the `iovcnt` buffers of `iov` in order to `inode`,
+        beginning at `offset`. same rules as `readv`.
+
+        @return how many bytes you actually write.
+
+        @note caller must hold the lock of `inode`.
+     */
+    usize (*writev)(OpContext* ctx,
+                    Inode* inode,
+                    const IoVec* iov,
+                    usize iovcnt,
+                    usize offset);
+
+    /**
+        @brief start reading the blocks under `[offset, offset + count)` of
+        `inode` into the block cache, without waiting for them. the range is
+        clipped to the file size.
+
+        @note caller must hold the lock of `inode`.
+     */
+    void (*readahead)(Inode* inode, usize offset, usize count);
+
+    /**
+        @brief get page `index` of regular file `inode` from the page cache,
+        filling it from disk if it is not there. the page is pinned.
+
+        @note caller must hold the lock of `inode`.
+
+        @see `put_page` - the counterpart of this method.
+     */
+    CachedPage* (*get_page)(Inode* inode, usize index);
+
+    /**
+        @brief unpin a page from `get_page`. a frame that was mapped into
+        some address space in the meantime stays alive through its own
+        reference even if the page is evicted later.
+     */
+    void (*put_page)(CachedPage* page);
+
     /**
         @brief look up an entry named `name` in directory `inode`.
 
@@ -267,6 +423,16 @@ extern InodeTree inodes;
 void init_inodes(const SuperBlock* sblock, const BlockCache* cache);
 
 
+/**
+    @brief get the counters of the directory entry cache.
+ */
+void get_dcache_stats(DcacheStats* stats);
+
+/**
+    @brief get the counters of the page cache.
+ */
+void get_page_cache_stats(PageCacheStats* stats);
+
 Inode* namei(const char* path, OpContext* ctx);
 Inode* nameiparent(const char* path, char* name, OpContext* ctx);
 void stati(Inode* ip, struct stat* st);
\ No newline at end of file
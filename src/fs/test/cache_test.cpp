@@ -155,6 +155,35 @@ void test_lru()
     assert_true(mock.write_count < 5);
 }
 
+// reports lookup latency and hit rate under a skewed workload.
+void test_lookup_bench()
+{
+    std::mt19937 gen(0x19260817);
+
+    usize cold_size = 1000;
+    usize hot_size = EVICTION_THRESHOLD / 2;
+    initialize(1, cold_size + hot_size);
+
+    constexpr usize num_rounds = 100000;
+    auto t0 = std::chrono::steady_clock::now();
+    for (usize i = 0; i < num_rounds; i++) {
+        bool hot = (gen() % 100) < 90;
+        usize bno = hot ? (gen() % hot_size) : (hot_size + gen() % cold_size);
+        bcache.release(bcache.acquire(bno));
+    }
+    auto t1 = std::chrono::steady_clock::now();
+
+    BlockCacheStats stats;
+    bcache.get_stats(&stats);
+    double ns = std::chrono::duration<double, std::nano>(t1 - t0).count();
+    printf("(debug) lookup latency = %.1f ns, hit rate = %.2f%%, "
+           "#evictions = %zu\n",
+           ns / num_rounds, 100.0 * stats.hits / num_rounds, stats.evictions);
+    assert_eq(stats.hits + stats.misses, num_rounds);
+    assert_true(stats.misses <= mock.read_count);
+    assert_true(bcache.get_num_cached_blocks() <= EVICTION_THRESHOLD);
+}
+
 // targets: `begin_op`, `end_op`, `sync`.
 
 void test_atomic_op()
@@ -482,6 +511,36 @@ void test_alloc_free()
     }
 }
 
+void test_alloc_near()
+{
+    initialize(100, 100);
+
+    OpContext ctx;
+    bcache.begin_op(&ctx);
+    usize first = bcache.alloc(&ctx);
+    bcache.end_op(&ctx);
+
+    // a sequential writer gets a contiguous run.
+    for (usize i = 1; i < 8; i++) {
+        bcache.begin_op(&ctx);
+        assert_eq(bcache.alloc_near(&ctx, first + i), first + i);
+        bcache.end_op(&ctx);
+    }
+
+    // a taken goal falls through to the next free block.
+    bcache.begin_op(&ctx);
+    assert_eq(bcache.alloc_near(&ctx, first), first + 8);
+    bcache.free(&ctx, first + 3);
+    bcache.end_op(&ctx);
+
+    bcache.begin_op(&ctx);
+    assert_eq(bcache.alloc_near(&ctx, first + 3), first + 3);
+    // next fit: without a goal, the search goes on after the last one.
+    usize next = bcache.alloc(&ctx);
+    assert_true(next > first + 8);
+    bcache.end_op(&ctx);
+}
+
 } // namespace basic
 
 namespace concurrent
@@ -682,7 +741,7 @@ void test_simple_crash()
 }
 
 void test_parallel(usize num_rounds, usize num_workers, usize delay_ms,
-                   usize log_cut)
+                   usize log_cut, bool group_commit = false)
 {
     usize log_size = num_workers * OP_MAX_NUM_BLOCKS - log_cut;
     usize num_data_blocks = 200 + num_workers * OP_MAX_NUM_BLOCKS;
@@ -701,6 +760,14 @@ void test_parallel(usize num_rounds, usize num_workers, usize delay_ms,
             }
 
             init_bcache(&sblock, &device);
+            if (group_commit) {
+                std::thread([] {
+                    try {
+                        bcache_checkpointer(0);
+                    } catch (const Offline &) {
+                    }
+                }).detach();
+            }
 
             std::atomic<bool> started = false;
             for (usize i = 0; i < num_workers; i++) {
@@ -923,6 +990,7 @@ int main()
         { "loop_read", basic::test_loop_read },
         { "reuse", basic::test_reuse },
         { "lru", basic::test_lru },
+        { "lookup_bench", basic::test_lookup_bench },
         { "atomic_op", basic::test_atomic_op },
         { "overflow", basic::test_overflow },
         { "resident", basic::test_resident },
@@ -931,6 +999,7 @@ int main()
         { "replay", basic::test_replay },
         { "alloc", basic::test_alloc },
         { "alloc_free", basic::test_alloc_free },
+        { "alloc_near", basic::test_alloc_near },
 
         { "concurrent_acquire", concurrent::test_acquire },
         { "concurrent_sync", concurrent::test_sync },
@@ -944,6 +1013,12 @@ int main()
         { "parallel_4",
           [] { crash::test_parallel(500, 4, 10, 2 * OP_MAX_NUM_BLOCKS); } },
         { "banker", crash::test_banker },
+        { "group_commit_1",
+          [] { crash::test_parallel(1000, 4, 5, 0, true); } },
+        { "group_commit_2",
+          [] {
+              crash::test_parallel(500, 4, 10, 2 * OP_MAX_NUM_BLOCKS, true);
+          } },
     };
     Runner(tests).run();
 
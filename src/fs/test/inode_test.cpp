@@ -408,6 +408,422 @@ void test_dir()
     }
 }
 
+void test_huge_file()
+{
+    mock.begin_op(ctx);
+    usize ino = inodes.alloc(ctx, INODE_REGULAR);
+    mock.end_op(ctx);
+
+    // goes through the double indirect block.
+    constexpr usize num_blocks = 300;
+    constexpr usize chunk = 4 * BLOCK_SIZE;
+    constexpr usize max_size = num_blocks * BLOCK_SIZE;
+    static_assert(num_blocks > INODE_NUM_DIRECT + INODE_NUM_INDIRECT);
+    static u8 buf[max_size], copy[max_size];
+    std::mt19937 gen(0xdeadbeef);
+    for (usize i = 0; i < max_size; i++) {
+        copy[i] = buf[i] = gen() & 0xff;
+    }
+
+    auto *p = inodes.get(ino);
+    inodes.lock(p);
+    for (usize i = 0; i < max_size; i += chunk) {
+        mock.begin_op(ctx);
+        inodes.write(ctx, p, buf + i, i, chunk);
+        mock.end_op(ctx);
+    }
+    assert_eq(mock.inspect(ino)->num_bytes, max_size);
+    assert_ne(mock.inspect(ino)->dindirect, 0);
+
+    for (usize i = 0; i < max_size; i++) {
+        buf[i] = 0;
+    }
+    inodes.read(p, buf, 0, max_size);
+    for (usize i = 0; i < max_size; i++) {
+        assert_eq(buf[i], copy[i]);
+    }
+
+    // reads crossing the indirect/double indirect boundary.
+    for (usize k = 0; k < 100; k++) {
+        usize off = gen() % max_size;
+        usize n = std::min(static_cast<usize>(gen() % 20000), max_size - off);
+        u8 part[20000];
+        inodes.read(p, part, off, n);
+        for (usize j = 0; j < n; j++) {
+            assert_eq(part[j], copy[off + j]);
+        }
+    }
+    inodes.unlock(p);
+
+    mock.begin_op(ctx);
+    inodes.put(ctx, p);
+    mock.end_op(ctx);
+
+    assert_eq(mock.count_inodes(), 1);
+    assert_eq(mock.count_blocks(), 0);
+}
+
+void test_vectored()
+{
+    mock.begin_op(ctx);
+    usize ino = inodes.alloc(ctx, INODE_REGULAR);
+    mock.end_op(ctx);
+
+    // more blocks than one batch, and buffers that straddle blocks.
+    constexpr usize max_size = (CACHE_MAX_BATCH + 5) * BLOCK_SIZE + 77;
+    static u8 buf[max_size], copy[max_size];
+    std::mt19937 gen(0xabcdef);
+    for (usize i = 0; i < max_size; i++) {
+        copy[i] = buf[i] = gen() & 0xff;
+    }
+
+    auto split = [&](u8 *base, IoVec *iov) {
+        usize n = 0;
+        for (usize off = 0; off < max_size; n++) {
+            usize len = std::min(static_cast<usize>(gen() % 1500), max_size - off);
+            iov[n] = { base + off, len };
+            off += len;
+        }
+        return n;
+    };
+
+    static IoVec iov[max_size];
+    usize n = split(buf, iov);
+
+    auto *p = inodes.get(ino);
+    inodes.lock(p);
+    mock.begin_op(ctx);
+    assert_eq(inodes.writev(ctx, p, iov, n, 0), max_size);
+    mock.end_op(ctx);
+    assert_eq(mock.inspect(ino)->num_bytes, max_size);
+
+    for (usize i = 0; i < max_size; i++) {
+        buf[i] = 0;
+    }
+    n = split(buf, iov);
+    assert_eq(inodes.readv(p, iov, n, 0), max_size);
+    for (usize i = 0; i < max_size; i++) {
+        assert_eq(buf[i], copy[i]);
+    }
+
+    // reads are cut at the end of file.
+    IoVec tail[2] = { { buf, 100 }, { buf + 100, 1000 } };
+    assert_eq(inodes.readv(p, tail, 2, max_size - 300), 300);
+    for (usize i = 0; i < 300; i++) {
+        assert_eq(buf[i], copy[max_size - 300 + i]);
+    }
+    inodes.unlock(p);
+
+    mock.begin_op(ctx);
+    inodes.put(ctx, p);
+    mock.end_op(ctx);
+    assert_eq(mock.count_blocks(), 0);
+}
+
+void test_readahead()
+{
+    mock.begin_op(ctx);
+    usize ino = inodes.alloc(ctx, INODE_REGULAR);
+    mock.end_op(ctx);
+
+    constexpr usize max_size = 3 * CACHE_MAX_BATCH * BLOCK_SIZE + 5;
+    static u8 buf[max_size], copy[max_size];
+    for (usize i = 0; i < max_size; i++) {
+        copy[i] = buf[i] = (u8)(i * 7);
+    }
+
+    auto *p = inodes.get(ino);
+    inodes.lock(p);
+    // nothing to prefetch in an empty file.
+    inodes.readahead(p, 0, max_size);
+    for (usize i = 0; i < max_size; i += 2 * BLOCK_SIZE) {
+        mock.begin_op(ctx);
+        inodes.write(ctx, p, buf + i, i, std::min(static_cast<usize>(2 * BLOCK_SIZE), max_size - i));
+        mock.end_op(ctx);
+    }
+
+    // ranges past the end are clipped, then the data reads back as usual.
+    inodes.readahead(p, BLOCK_SIZE + 3, 10 * max_size);
+    inodes.readahead(p, max_size, BLOCK_SIZE);
+    for (usize i = 0; i < max_size; i++) {
+        buf[i] = 0;
+    }
+    assert_eq(inodes.read(p, buf, 0, max_size), max_size);
+    for (usize i = 0; i < max_size; i++) {
+        assert_eq(buf[i], copy[i]);
+    }
+    inodes.unlock(p);
+
+    mock.begin_op(ctx);
+    inodes.put(ctx, p);
+    mock.end_op(ctx);
+    assert_eq(mock.count_blocks(), 0);
+}
+
+void test_page_cache()
+{
+    mock.begin_op(ctx);
+    usize ino = inodes.alloc(ctx, INODE_REGULAR);
+    mock.end_op(ctx);
+
+    constexpr usize num_pages = PAGE_CACHE_MAX + 4;
+    constexpr usize max_size = num_pages * PAGE_SIZE - 9;
+    static u8 buf[max_size], copy[max_size];
+    for (usize i = 0; i < max_size; i++) {
+        copy[i] = buf[i] = (u8)(i * 13);
+    }
+
+    auto *p = inodes.get(ino);
+    inodes.lock(p);
+    mock.begin_op(ctx);
+    inodes.write(ctx, p, buf, 0, 2 * PAGE_SIZE);
+    mock.end_op(ctx);
+
+    // the first read fills a page, the next ones hit it.
+    PageCacheStats before, after;
+    get_page_cache_stats(&before);
+    assert_eq(inodes.read(p, buf, 5, 100), 100);
+    assert_eq(inodes.read(p, buf + 100, 105, 200), 200);
+    get_page_cache_stats(&after);
+    assert_eq(after.misses - before.misses, 1);
+    assert_eq(after.hits - before.hits, 1);
+
+    // the page past the end of the file is zeroed, and a write shows up in
+    // both the cached pages and the pages filled after it.
+    auto *page = inodes.get_page(p, 2);
+    for (usize i = 0; i < PAGE_SIZE; i++) {
+        assert_eq(page->data[i], 0);
+    }
+    inodes.put_page(page);
+    for (usize i = 0; i < max_size; i += 2 * BLOCK_SIZE) {
+        mock.begin_op(ctx);
+        inodes.write(ctx, p, copy + i, i, std::min(static_cast<usize>(2 * BLOCK_SIZE), max_size - i));
+        mock.end_op(ctx);
+    }
+    page = inodes.get_page(p, 2);
+    assert_eq(page->data[7], copy[2 * PAGE_SIZE + 7]);
+    inodes.put_page(page);
+
+    // reading more than the cache holds evicts the older pages.
+    get_page_cache_stats(&before);
+    for (usize i = 0; i < max_size; i++) {
+        buf[i] = 0;
+    }
+    assert_eq(inodes.read(p, buf, 0, max_size), max_size);
+    for (usize i = 0; i < max_size; i++) {
+        assert_eq(buf[i], copy[i]);
+    }
+    get_page_cache_stats(&after);
+    assert_true(after.evictions - before.evictions >= num_pages - PAGE_CACHE_MAX);
+
+    // a pinned page survives eviction.
+    page = inodes.get_page(p, 0);
+    assert_eq(inodes.read(p, buf, PAGE_SIZE, max_size - PAGE_SIZE), max_size - PAGE_SIZE);
+    assert_eq(inodes.get_page(p, 0), page);
+    inodes.put_page(page);
+    inodes.put_page(page);
+    inodes.unlock(p);
+
+    mock.begin_op(ctx);
+    inodes.put(ctx, p);
+    mock.end_op(ctx);
+    assert_eq(mock.count_blocks(), 0);
+}
+
+void test_alloc_near()
+{
+    constexpr usize near = 10 * INODE_PER_BLOCK + 3;
+    usize ino[INODE_PER_BLOCK + 1];
+
+    // the block of `near` fills up first, then the search moves on.
+    mock.begin_op(ctx);
+    for (usize i = 0; i <= INODE_PER_BLOCK; i++) {
+        ino[i] = inodes.alloc_near(ctx, INODE_REGULAR, near);
+    }
+    mock.end_op(ctx);
+    for (usize i = 0; i < INODE_PER_BLOCK; i++) {
+        assert_eq(ino[i] / INODE_PER_BLOCK, near / INODE_PER_BLOCK);
+        assert_eq(mock.inspect(ino[i])->type, INODE_REGULAR);
+    }
+    assert_eq(ino[INODE_PER_BLOCK] / INODE_PER_BLOCK, near / INODE_PER_BLOCK + 1);
+
+    // a freed inode is found again.
+    auto *p = inodes.get(ino[2]);
+    mock.begin_op(ctx);
+    inodes.put(ctx, p);
+    mock.end_op(ctx);
+    mock.begin_op(ctx);
+    assert_eq(inodes.alloc_near(ctx, INODE_REGULAR, near), ino[2]);
+    mock.end_op(ctx);
+
+    for (usize i = 0; i <= INODE_PER_BLOCK; i++) {
+        p = inodes.get(ino[i]);
+        mock.begin_op(ctx);
+        inodes.put(ctx, p);
+        mock.end_op(ctx);
+    }
+    assert_eq(mock.count_inodes(), 1);
+}
+
+void test_lru()
+{
+    constexpr usize n = INODE_LRU_MAX * 2;
+    usize ino[n];
+    usize before = mock.count_inodes();
+
+    // linked inodes outlive their last reference.
+    mock.begin_op(ctx);
+    for (usize i = 0; i < n; i++) {
+        ino[i] = inodes.alloc(ctx, INODE_DEVICE);
+        auto *p = inodes.get(ino[i]);
+        inodes.lock(p);
+        p->entry.num_links = 1;
+        p->entry.major = (u16)i;
+        inodes.sync(ctx, p, true);
+        inodes.unlock(p);
+        inodes.put(ctx, p);
+    }
+    mock.end_op(ctx);
+    assert_eq(mock.count_inodes(), before + n);
+
+    // the most recently put one is still in memory.
+    auto *p = inodes.get(ino[n - 1]);
+    auto *q = inodes.get(ino[n - 1]);
+    assert_eq(p, q);
+    assert_eq(p->rc.count, 2);
+    mock.begin_op(ctx);
+    inodes.put(ctx, p);
+    inodes.put(ctx, q);
+    mock.end_op(ctx);
+
+    // evicted or not, every inode comes back intact.
+    for (usize i = 0; i < n; i++) {
+        mock.begin_op(ctx);
+        p = inodes.get(ino[i]);
+        inodes.lock(p);
+        assert_eq(p->entry.type, INODE_DEVICE);
+        assert_eq(p->entry.major, i);
+        p->entry.num_links = 0;
+        inodes.sync(ctx, p, true);
+        inodes.unlock(p);
+        inodes.put(ctx, p);
+        mock.end_op(ctx);
+    }
+    assert_eq(mock.count_inodes(), before);
+}
+
+void test_dcache()
+{
+    mock.begin_op(ctx);
+    usize dir = inodes.alloc(ctx, INODE_DIRECTORY);
+    usize ino = inodes.alloc(ctx, INODE_REGULAR);
+    mock.end_op(ctx);
+
+    auto *p = inodes.get(dir);
+    inodes.lock(p);
+    DcacheStats s0, s1;
+
+    // a miss is remembered as a negative entry.
+    get_dcache_stats(&s0);
+    assert_eq(inodes.lookup(p, "ghost", NULL), 0);
+    assert_eq(inodes.lookup(p, "ghost", NULL), 0);
+    get_dcache_stats(&s1);
+    assert_eq(s1.misses - s0.misses, 1);
+    assert_eq(s1.neg_hits - s0.neg_hits, 1);
+
+    // insert turns it into a positive one.
+    mock.begin_op(ctx);
+    usize index = inodes.insert(ctx, p, "ghost", ino);
+    mock.end_op(ctx);
+    usize found = 0;
+    get_dcache_stats(&s0);
+    assert_eq(inodes.lookup(p, "ghost", &found), ino);
+    assert_eq(found, index);
+    get_dcache_stats(&s1);
+    assert_eq(s1.hits - s0.hits, 1);
+    assert_eq(s1.misses, s0.misses);
+
+    // remove and clear are seen by later lookups.
+    mock.begin_op(ctx);
+    inodes.remove(ctx, p, index);
+    mock.end_op(ctx);
+    assert_eq(inodes.lookup(p, "ghost", NULL), 0);
+
+    mock.begin_op(ctx);
+    inodes.insert(ctx, p, "ghost", ino);
+    mock.end_op(ctx);
+    assert_eq(inodes.lookup(p, "ghost", NULL), ino);
+    mock.begin_op(ctx);
+    inodes.clear(ctx, p);
+    mock.end_op(ctx);
+    assert_eq(inodes.lookup(p, "ghost", NULL), 0);
+
+    inodes.unlock(p);
+    mock.begin_op(ctx);
+    inodes.put(ctx, p);
+    auto *q = inodes.get(ino);
+    inodes.put(ctx, q);
+    mock.end_op(ctx);
+}
+
+void test_indexed_dir()
+{
+    constexpr usize nb = 2;
+    constexpr usize n = nb * DIR_PER_BLOCK + 8;
+    static u8 zero[nb * BLOCK_SIZE];
+
+    mock.begin_op(ctx);
+    usize dir = inodes.alloc(ctx, INODE_DIRECTORY);
+    mock.end_op(ctx);
+
+    auto *p = inodes.get(dir);
+    inodes.lock(p);
+    mock.begin_op(ctx);
+    inodes.write(ctx, p, zero, 0, sizeof(zero));
+    p->entry.major = nb;
+    inodes.sync(ctx, p, true);
+    mock.end_op(ctx);
+
+    // more entries than the buckets hold, so the linear tail is used too.
+    usize index[n];
+    for (usize i = 0; i < n; i++) {
+        auto name = "f" + std::to_string(i);
+        mock.begin_op(ctx);
+        index[i] = inodes.insert(ctx, p, name.data(), 100 + i);
+        mock.end_op(ctx);
+        assert_ne(index[i], (usize)-1);
+        if (i < DIR_PER_BLOCK)
+            assert_eq(index[i] / BLOCK_SIZE, dir_hash(name.data()) % nb);
+    }
+    assert_eq(p->entry.num_bytes, (nb * DIR_PER_BLOCK + 8) * sizeof(DirEntry));
+
+    for (usize i = 0; i < n; i++) {
+        auto name = "f" + std::to_string(i);
+        usize found = 0;
+        assert_eq(inodes.lookup(p, name.data(), &found), 100 + i);
+        assert_eq(found, index[i]);
+        mock.begin_op(ctx);
+        assert_eq(inodes.insert(ctx, p, name.data(), 1), (usize)-1);
+        mock.end_op(ctx);
+    }
+
+    // a removed slot is reused by the next insert on its probe path.
+    mock.begin_op(ctx);
+    inodes.remove(ctx, p, index[3]);
+    mock.end_op(ctx);
+    assert_eq(inodes.lookup(p, "f3", NULL), 0);
+    mock.begin_op(ctx);
+    assert_eq(inodes.insert(ctx, p, "f3", 103), index[3]);
+    mock.end_op(ctx);
+    assert_eq(inodes.lookup(p, "f3", NULL), 103);
+
+    mock.begin_op(ctx);
+    inodes.clear(ctx, p);
+    inodes.unlock(p);
+    inodes.put(ctx, p);
+    mock.end_op(ctx);
+}
+
 } // namespace adhoc
 
 int main()
@@ -424,7 +840,15 @@ int main()
         { "share", adhoc::test_share },
         { "small_file", adhoc::test_small_file },
         { "large_file", adhoc::test_large_file },
+        { "huge_file", adhoc::test_huge_file },
+        { "vectored", adhoc::test_vectored },
+        { "readahead", adhoc::test_readahead },
+        { "page_cache", adhoc::test_page_cache },
+        { "alloc_near", adhoc::test_alloc_near },
         { "dir", adhoc::test_dir },
+        { "lru", adhoc::test_lru },
+        { "dcache", adhoc::test_dcache },
+        { "indexed_dir", adhoc::test_indexed_dir },
     };
     Runner(tests).run();
 
@@ -21,4 +21,14 @@ void kfree(void *object)
 {
     free(object);
 }
+
+void *kalloc_page()
+{
+    return aligned_alloc(4096, 4096);
+}
+
+void kfree_page(void *page)
+{
+    free(page);
+}
 }
@@ -18,6 +18,10 @@ static usize stub_alloc(OpContext *ctx) {
     return mock.alloc(ctx);
 }
 
+static usize stub_alloc_near(OpContext *ctx, usize) {
+    return mock.alloc(ctx);
+}
+
 static void stub_free(OpContext *ctx, usize block_no) {
     mock.free(ctx, block_no);
 }
@@ -26,6 +30,17 @@ static Block *stub_acquire(usize block_no) {
     return mock.acquire(block_no);
 }
 
+static void stub_acquire_batch(usize n, const usize *block_no, Block **blocks) {
+    for (usize i = 0; i < n; i++)
+        blocks[i] = mock.acquire(block_no[i]);
+}
+
+// the mock has no asynchronous reads, so fill the blocks right away.
+static void stub_prefetch(usize n, const usize *block_no) {
+    for (usize i = 0; i < n; i++)
+        mock.release(mock.acquire(block_no[i]));
+}
+
 static void stub_release(Block *block) {
     return mock.release(block);
 }
@@ -41,8 +56,11 @@ static struct _Loader {
         cache.begin_op = stub_begin_op;
         cache.end_op = stub_end_op;
         cache.alloc = stub_alloc;
+        cache.alloc_near = stub_alloc_near;
         cache.free = stub_free;
         cache.acquire = stub_acquire;
+        cache.acquire_batch = stub_acquire_batch;
+        cache.prefetch = stub_prefetch;
         cache.release = stub_release;
         cache.sync = stub_sync;
     }
@@ -79,6 +79,20 @@ void acquire_spinlock(struct SpinLock *lock)
     mtx_map[lock].lock();
 }
 
+bool try_acquire_spinlock(struct SpinLock *lock)
+{
+    if (holding++ == 0)
+        blocker.p();
+    auto &m = mtx_map[lock];
+    if (m.mutex.try_lock()) {
+        m.locked = true;
+        return true;
+    }
+    if (--holding == 0)
+        blocker.v();
+    return false;
+}
+
 void release_spinlock(struct SpinLock *lock)
 {
     mtx_map[lock].unlock();
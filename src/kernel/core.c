@@ -7,6 +7,7 @@
 #include <kernel/proc.h>
 #include <kernel/paging.h>
 #include <kernel/mem.h>
+#include <common/string.h>
 
 volatile bool panic_flag;
 extern char icode[],eicode[];
@@ -38,6 +39,8 @@ NO_RETURN void kernel_entry()
     // vm_test();
     // user_proc_test();
     // io_test();
+    // ctxsw_test();
+    // hugepage_test();
 
     /**
      * (Final) TODO BEGIN 
@@ -48,12 +51,17 @@ NO_RETURN void kernel_entry()
     auto p=create_proc();
 
     struct section* sec=kalloc(sizeof(struct section));
+    memset(sec,0,sizeof(struct section));
     sec->begin=0x400000;
     sec->end = 0x400000+(u64)eicode-(u64)icode;
     sec->flags=ST_TEXT;
-    _insert_into_list(&p->pgdir.section_head,&sec->stnode);
+    if(add_section(&p->pgdir,sec)!=0)PANIC();
     for(u64 i=(u64)icode;i<(u64)eicode;i+=PAGE_SIZE){
-        *get_pte(&p->pgdir,0x400000+i-(u64)icode,true)=K2P(i)|PTE_USER_DATA;
+        // these pages belong to the kernel image: the mapping gets one
+        // reference and the kernel keeps another, so that dropping the
+        // mapping on exec never hands them to the page allocator.
+        kshare_page((void*)i);
+        vmmap(&p->pgdir,0x400000+i-(u64)icode,kshare_page((void*)i),PTE_USER_DATA);
     }
 
     p->ucontext->x[0]=0;
@@ -3,8 +3,6 @@
 #include <kernel/proc.h>
 #include <common/rbtree.h>
 
-#define NCPU 4
-
 struct timer {
     bool triggered;
     int elapse;
@@ -16,6 +14,10 @@ struct timer {
 
 struct sched {
     // TODO: customize your sched info
+    SpinLock lock;
+    struct rb_root_ rq;
+    int nr_running;
+    u64 min_vruntime;
     Proc* thisproc;
     Proc* idle;
     struct timer sched_timer;
@@ -18,13 +18,14 @@
 
 extern int fdalloc(struct file *f);
 
-void execve_error(struct pgdir* pd,Inode* ip,OpContext* ctx){
+void execve_error(struct pgdir* pd,Inode* ip,OpContext* ctx,struct file* fp){
+    free_sections(pd);
     free_pgdir(pd);
     kfree(pd);
     inodes.unlock(ip);
     inodes.put(ctx,ip);
     bcache.end_op(ctx);
-
+    if(fp)file_close(fp);
 }
 
 int execve(const char *path, char *const argv[], char *const envp[])
@@ -51,21 +52,31 @@ int execve(const char *path, char *const argv[], char *const envp[])
   
     inodes.lock(ip);
     Elf64_Ehdr elf;
+    struct file* fp=NULL;
     
     if(inodes.read(ip,(u8*)&elf,0,sizeof(Elf64_Ehdr))!=sizeof(Elf64_Ehdr)){
-        execve_error(pd,ip,&ctx);
+        execve_error(pd,ip,&ctx,fp);
         return -1;
     }
    
-    if(elf.e_ident[EI_MAG0]!=ELFMAG0){execve_error(pd,ip,&ctx);return -1;}
-    if(elf.e_ident[EI_MAG1]!=ELFMAG1){execve_error(pd,ip,&ctx);return -1;}
-    if(elf.e_ident[EI_MAG2]!=ELFMAG2){execve_error(pd,ip,&ctx);return -1;}
-    if(elf.e_ident[EI_MAG3]!=ELFMAG3){execve_error(pd,ip,&ctx);return -1;}
-    if(elf.e_ident[EI_CLASS]!=ELFCLASS64){execve_error(pd,ip,&ctx);return -1;}
+    if(elf.e_ident[EI_MAG0]!=ELFMAG0){execve_error(pd,ip,&ctx,fp);return -1;}
+    if(elf.e_ident[EI_MAG1]!=ELFMAG1){execve_error(pd,ip,&ctx,fp);return -1;}
+    if(elf.e_ident[EI_MAG2]!=ELFMAG2){execve_error(pd,ip,&ctx,fp);return -1;}
+    if(elf.e_ident[EI_MAG3]!=ELFMAG3){execve_error(pd,ip,&ctx,fp);return -1;}
+    if(elf.e_ident[EI_CLASS]!=ELFCLASS64){execve_error(pd,ip,&ctx,fp);return -1;}
+
+    // every section of the image reads its pages through this file.
+    fp=file_alloc();
+    if(fp==NULL){execve_error(pd,ip,&ctx,fp);return -1;}
+    fp->type=FD_INODE;
+    fp->ip=inodes.share(ip);
+    fp->off=0;
+    fp->readable=true;
+    fp->writable=false;
 
     for(usize i=0,off=elf.e_phoff;i<elf.e_phnum;i++,off+=sizeof(Elf64_Phdr)){
         Elf64_Phdr ph;
-        if(inodes.read(ip,(u8*)&ph,off,sizeof(Elf64_Phdr))!=sizeof(Elf64_Phdr)){execve_error(pd,ip,&ctx);return -1;}
+        if(inodes.read(ip,(u8*)&ph,off,sizeof(Elf64_Phdr))!=sizeof(Elf64_Phdr)){execve_error(pd,ip,&ctx,fp);return -1;}
         if(ph.p_type!=PT_LOAD)continue;
 
         u64 sec_flag=0,end=0;
@@ -77,46 +88,22 @@ int execve(const char *path, char *const argv[], char *const envp[])
             sec_flag=ST_FILE;
             end=ph.p_vaddr+ph.p_memsz;
         }
-        else{execve_error(pd,ip,&ctx);return -1;}
+        else{execve_error(pd,ip,&ctx,fp);return -1;}
 
+        // nothing is loaded yet: the pages come in on their first fault.
         struct section* sec=kalloc(sizeof(struct section));
         memset(sec,0,sizeof(struct section));
         sec->begin=ph.p_vaddr;
         sec->end=end;
         sec->flags=sec_flag;
-        _insert_into_list(&pd->section_head,&sec->stnode);
-
-        u64 va=ph.p_vaddr,ph_off=ph.p_offset;
-        while(va<ph.p_vaddr+ph.p_filesz){
-            u64 va0=PAGE_BASE(va);
-            u64 sz=MIN(PAGE_SIZE-(va-va0),ph.p_vaddr+ph.p_filesz-va);
-
-            void *p=kalloc_page();
-            memset(p,0,PAGE_SIZE);
-            u64 pte_flag=PTE_USER_DATA;
-            if(sec_flag==ST_TEXT)pte_flag|=PTE_RO;
-            vmmap(pd,va0,p,pte_flag);
-            
-            if(inodes.read(ip,(u8*)p+va-va0,ph_off,sz)!=sz){
-                execve_error(pd,ip,&ctx);
-                return -1;
-            }
-
-            // for(usize i=0;i<sz;++i)printk("%c",*((u8*)p+va-va0+i));
-
-            va+=sz;
-            ph_off+=sz;
-        }
-
-        if(va!=PAGE_BASE(va))va=PAGE_BASE(va)+PAGE_SIZE;
-
-        if(sec_flag==ST_FILE&&ph.p_memsz>va-ph.p_vaddr){
-            while(va<ph.p_vaddr+ph.p_memsz){
-                u64 va0=PAGE_BASE(va);
-                u64 sz=MIN(PAGE_SIZE-(va-va0),ph.p_vaddr+ph.p_memsz-va);
-                vmmap(pd,va0,get_zero_page(),PTE_USER_DATA|PTE_RO);
-                va+=sz;
-            }
+        sec->fp=file_dup(fp);
+        sec->offset=ph.p_offset;
+        sec->length=ph.p_filesz;
+        if(add_section(pd,sec)!=0){
+            file_close(sec->fp);
+            kfree(sec);
+            execve_error(pd,ip,&ctx,fp);
+            return -1;
         }
     }
     
@@ -124,19 +111,24 @@ int execve(const char *path, char *const argv[], char *const envp[])
     inodes.put(&ctx,ip);
     bcache.end_op(&ctx);
 
+    file_close(fp);
+
+    // the stack grows by faults as well, apart from the pages that the
+    // arguments are copied into below.
     u64 sp=USERTOP;
-    for(int i=1;i<=STACK_PAGE_SIZE;++i){
-        void* p=kalloc_page();
-        memset(p,0,PAGE_SIZE);
-        vmmap(pd,sp-i*PAGE_SIZE,p,PTE_USER_DATA);
-    }
 
     struct section *sec=kalloc(sizeof(struct section));
     memset(sec,0,sizeof(struct section));
     sec->flags=ST_STK;
     sec->begin=sp-STACK_PAGE_SIZE*PAGE_SIZE;
     sec->end=sp;
-    _insert_into_list(&pd->section_head,&sec->stnode);
+    if(add_section(pd,sec)!=0){
+        kfree(sec);
+        free_sections(pd);
+        free_pgdir(pd);
+        kfree(pd);
+        return -1;
+    }
 
     Proc* this_proc=thisproc();
     
@@ -180,6 +172,10 @@ int execve(const char *path, char *const argv[], char *const envp[])
 	sp-=8;
     copyout(pd, (void*)sp, &argc, sizeof(argc));
 
+	// drop the old image, so that frames still shared with a parent after
+	// fork go back to a single owner. mappings do not survive exec either.
+	free_vmas(this_proc);
+	free_sections(&this_proc->pgdir);
 	free_pgdir(&this_proc->pgdir);
 	this_proc->ucontext->sp = sp;
 	this_proc->ucontext->elr = elf.e_entry;
@@ -189,8 +185,8 @@ int execve(const char *path, char *const argv[], char *const envp[])
     pd->section_head.next->prev=&this_proc->pgdir.section_head;
 
 	kfree(pd);
+	// the new image gets a fresh ASID, so nothing needs flushing.
 	attach_pgdir(&(this_proc->pgdir));
-    arch_tlbi_vmalle1is();
 
 	return 0;
 
@@ -13,31 +13,107 @@ struct page refpage[PAGE_TOTAL];
 struct page* zero_page=NULL;
 
 extern char end[];
-static SpinLock memlock;
-
-typedef struct _MyListNode{
-    struct _MyListNode* next;
-}MyListNode;
-void add_to_list(MyListNode** head,MyListNode* p){
-    p->next=*head;
-    *head=p;
-}
-void* fetch_from_list(MyListNode** head){
-    MyListNode* p=*head;
-    *head=(*head)->next;
-    return p;
+
+static void kmem_init();
+
+// The 2 MiB pages are HUGE_PAGE_POOL aligned chunks at the top of RAM, which
+// kalloc_page never hands out. A block entry mapping a chunk holds one
+// reference in `ref`. When a block mapping is split into page entries, each
+// of them takes a reference to its own 4 KiB page in refpage instead, and
+// `nsub` counts the pages of the chunk that still have one. The chunk goes
+// back to the pool when both are 0, never to the 4 KiB free list.
+#define HUGE_START (P2K(PHYSTOP) - (u64)HUGE_PAGE_POOL * HUGE_PAGE_SIZE)
+
+struct huge_page{
+    isize ref;
+    int nsub;
+};
+
+static SpinLock hugelock;
+static QueueNode* huge_pages=NULL;
+static struct huge_page hugepage[HUGE_PAGE_POOL];
+static u64 huge_free_cnt=0;
+
+static INLINE struct huge_page* huge_of(void* p){
+    return &hugepage[((u64)p-HUGE_START)/HUGE_PAGE_SIZE];
 }
 
+static SpinLock pagelock;
 static QueueNode* pages=NULL;
 
+// Per-CPU magazine of free pages in front of the global pool. Magazines are
+// refilled and drained PCP_BATCH pages at a time to amortize pagelock. The
+// lock of a magazine is only contended when the global pool has run dry and
+// another CPU steals from it, so taking it costs the owner no cache misses.
+#define PCP_BATCH 32
+#define PCP_HIGH 128
+
+struct page_cache{
+    SpinLock lock;
+    QueueNode* head;
+    int count;
+} __attribute__((aligned(64)));
+
+static struct page_cache pcp[NCPU];
+bool page_cache_enabled=true;
+
+// move up to PCP_BATCH pages from the global pool into c. call with c->lock
+static void pcp_refill(struct page_cache* c){
+    acquire_spinlock(&pagelock);
+    while(pages&&c->count<PCP_BATCH){
+        QueueNode* p=pages;
+        pages=p->next;
+        p->next=c->head;
+        c->head=p;
+        c->count++;
+    }
+    release_spinlock(&pagelock);
+}
+
+// take one page from any magazine, for when the global pool is empty.
+static QueueNode* pcp_steal(){
+    for(int i=0;i<NCPU;i++){
+        auto c=&pcp[i];
+        acquire_spinlock(&c->lock);
+        QueueNode* p=c->head;
+        if(p){
+            c->head=p->next;
+            c->count--;
+        }
+        release_spinlock(&c->lock);
+        if(p)return p;
+    }
+    return NULL;
+}
+
+// give PCP_BATCH pages of c back to the global pool. call with c->lock
+static void pcp_drain(struct page_cache* c){
+    QueueNode* first=c->head;
+    QueueNode* last=first;
+    for(int i=1;i<PCP_BATCH;i++)last=last->next;
+    c->head=last->next;
+    c->count-=PCP_BATCH;
+    acquire_spinlock(&pagelock);
+    last->next=pages;
+    pages=first;
+    release_spinlock(&pagelock);
+}
+
 void kinit() {
     init_rc(&kalloc_page_cnt);
-    init_spinlock(&memlock);
+    init_spinlock(&pagelock);
+    init_spinlock(&hugelock);
+    for(int i=0;i<NCPU;i++)init_spinlock(&pcp[i].lock);
+    kmem_init();
 
-    for(u64 i=PAGE_BASE((u64)&end)+PAGE_SIZE*2;i+PAGE_SIZE<P2K(PHYSTOP);i+=PAGE_SIZE){
+    for(u64 i=PAGE_BASE((u64)&end)+PAGE_SIZE*2;i+PAGE_SIZE<HUGE_START;i+=PAGE_SIZE){
         add_to_queue(&pages,(QueueNode*)i);
         page_total+=1;
     }
+    for(u64 i=HUGE_START;i<P2K(PHYSTOP);i+=HUGE_PAGE_SIZE){
+        add_to_queue(&huge_pages,(QueueNode*)i);
+        huge_free_cnt++;
+    }
     zero_page=(struct page*)(PAGE_BASE((u64)&end)+PAGE_SIZE);
     memset(zero_page,0,PAGE_SIZE);
     increment_rc(&refpage[K2P(zero_page)/PAGE_SIZE].ref);
@@ -47,31 +123,200 @@ u64 left_page_cnt(){
     return page_total-kalloc_page_cnt.count;
 }
 
+// NULL only when the global pool and every magazine are empty.
 void* kalloc_page() {
+    QueueNode* page;
+    if(page_cache_enabled){
+        auto c=&pcp[cpuid()];
+        acquire_spinlock(&c->lock);
+        if(!c->head)pcp_refill(c);
+        page=c->head;
+        if(page){
+            c->head=page->next;
+            c->count--;
+        }
+        release_spinlock(&c->lock);
+    }else{
+        acquire_spinlock(&pagelock);
+        page=pages;
+        if(page)pages=page->next;
+        release_spinlock(&pagelock);
+    }
+    // the other CPUs may still hold free pages in their magazines.
+    if(!page)page=pcp_steal();
+    if(!page)return NULL;
     increment_rc(&kalloc_page_cnt);
-    void *page=fetch_from_queue(&pages);
     increment_rc(&refpage[K2P(page)/PAGE_SIZE].ref);
     return page;
 }
 
+// call with hugelock
+static void huge_release(void* p){
+    auto h=huge_of(p);
+    if(h->ref==0&&h->nsub==0){
+        QueueNode* chunk=(QueueNode*)HUGE_PAGE_BASE(p);
+        chunk->next=huge_pages;
+        huge_pages=chunk;
+        huge_free_cnt++;
+    }
+}
+
 void kfree_page(void* p) {
-    decrement_rc(&refpage[K2P(p)/PAGE_SIZE].ref);
-    if(refpage[K2P(p)/PAGE_SIZE].ref.count==0){
+    if((u64)p>=HUGE_START){
+        acquire_spinlock(&hugelock);
+        if(decrement_rc(&refpage[K2P(p)/PAGE_SIZE].ref)){
+            huge_of(p)->nsub--;
+            huge_release(p);
+        }
+        release_spinlock(&hugelock);
+        return;
+    }
+    if(decrement_rc(&refpage[K2P(p)/PAGE_SIZE].ref)){
         decrement_rc(&kalloc_page_cnt);
-        add_to_queue(&pages,p);
+        QueueNode* page=p;
+        if(page_cache_enabled){
+            auto c=&pcp[cpuid()];
+            acquire_spinlock(&c->lock);
+            page->next=c->head;
+            c->head=page;
+            if(++c->count>PCP_HIGH)pcp_drain(c);
+            release_spinlock(&c->lock);
+        }else{
+            acquire_spinlock(&pagelock);
+            page->next=pages;
+            pages=page;
+            release_spinlock(&pagelock);
+        }
+    }
+}
+
+// Take one more reference to page `p`, e.g. for a second mapping of it.
+void* kshare_page(void* p) {
+    if((u64)p>=HUGE_START){
+        acquire_spinlock(&hugelock);
+        if(refpage[K2P(p)/PAGE_SIZE].ref.count==0)huge_of(p)->nsub++;
+        increment_rc(&refpage[K2P(p)/PAGE_SIZE].ref);
+        release_spinlock(&hugelock);
+        return p;
     }
+    increment_rc(&refpage[K2P(p)/PAGE_SIZE].ref);
+    return p;
+}
+
+// a page of a 2 MiB chunk is also held by every block mapping of the chunk.
+isize page_refcount(void* p) {
+    if((u64)p>=HUGE_START)
+        return refpage[K2P(p)/PAGE_SIZE].ref.count+huge_of(p)->ref;
+    return refpage[K2P(p)/PAGE_SIZE].ref.count;
+}
+
+void* kalloc_huge_page() {
+    acquire_spinlock(&hugelock);
+    QueueNode* p=huge_pages;
+    if(p){
+        huge_pages=p->next;
+        huge_free_cnt--;
+        huge_of(p)->ref=1;
+    }
+    release_spinlock(&hugelock);
+    return p;
+}
+
+void kfree_huge_page(void* p) {
+    acquire_spinlock(&hugelock);
+    huge_of(p)->ref--;
+    huge_release(p);
+    release_spinlock(&hugelock);
 }
 
+void* kshare_huge_page(void* p) {
+    acquire_spinlock(&hugelock);
+    huge_of(p)->ref++;
+    release_spinlock(&hugelock);
+    return p;
+}
+
+isize huge_page_refcount(void* p) {
+    acquire_spinlock(&hugelock);
+    auto h=huge_of(p);
+    isize res=h->ref+h->nsub;
+    release_spinlock(&hugelock);
+    return res;
+}
+
+u64 left_huge_page_cnt() {
+    return huge_free_cnt;
+}
+
+// Slab header at the base of every kalloc page. kfree finds the size class
+// of an object through the page it lives in. The header is kept to 16 bytes
+// so two 2040-byte or three 1360-byte objects still fit in one page, which
+// is why the partial list links are physical page numbers.
 typedef struct _PageHead{
-    u64 block_size;
+    u16 block_size;
+    u16 id;
+    u16 inuse;      // objects not on this slab's free list
+    u16 free;       // page offset of the first free object, 0 if none
+    u32 prev,next;  // partial list links, 0 if none
 }PageHead;
 
 #define BLOCK_TYPE 25
 const int BLOCK_SIZE[]={8,16,24,32,40,48,56,64,80,96,112,128,160,192,224,256,288,336,368,408,448,512,1360,2040,4096};
-static MyListNode *PowerHead[BLOCK_TYPE]={NULL};
-u64 PowerTail[BLOCK_TYPE]={0};
 
-// u64 BlockPage[BLOCK_TYPE]={0};
+// fully free slabs kept per class before pages go back to kalloc_page
+#define KMEM_KEEP_EMPTY 1
+#define KMEM_MAX_BATCH 32
+
+struct kmem_class{
+    SpinLock lock;
+    u32 partial;    // slabs with free objects
+    int nr_empty;   // slabs on the partial list with no object in use
+    int objs;       // objects per slab
+    int batch;      // objects moved per refill or flush
+    u64 slabs,refills,flushes;
+};
+
+// Per-CPU object cache of every class. As with the page magazines, a CPU
+// never switches away inside kalloc/kfree, so the fast path needs no lock.
+struct kmem_cpu{
+    QueueNode* head;
+    int count;
+    u64 allocs,frees;
+};
+
+static struct kmem_class kmem[BLOCK_TYPE];
+static struct{
+    struct kmem_cpu c[BLOCK_TYPE];
+} __attribute__((aligned(64))) kmem_cpus[NCPU];
+
+static INLINE PageHead* pn_to_slab(u32 pn){
+    return (PageHead*)P2K((u64)pn*PAGE_SIZE);
+}
+
+static INLINE u32 slab_to_pn(PageHead* h){
+    return K2P(h)/PAGE_SIZE;
+}
+
+static void partial_push(struct kmem_class* c,PageHead* h){
+    h->prev=0;
+    h->next=c->partial;
+    if(c->partial)pn_to_slab(c->partial)->prev=slab_to_pn(h);
+    c->partial=slab_to_pn(h);
+}
+
+static void partial_remove(struct kmem_class* c,PageHead* h){
+    if(h->prev)pn_to_slab(h->prev)->next=h->next;
+    else c->partial=h->next;
+    if(h->next)pn_to_slab(h->next)->prev=h->prev;
+}
+
+static void kmem_init(){
+    for(int i=0;i<BLOCK_TYPE;i++){
+        init_spinlock(&kmem[i].lock);
+        kmem[i].objs=(PAGE_SIZE-sizeof(PageHead))/BLOCK_SIZE[i];
+        kmem[i].batch=MAX(MIN(kmem[i].objs,KMEM_MAX_BATCH),1);
+    }
+}
 
 inline int get_id(u64 size){
     for(int i=0;i<BLOCK_TYPE;i++){
@@ -80,40 +325,111 @@ inline int get_id(u64 size){
     return BLOCK_TYPE-1;
 }
 
-void* kalloc(unsigned long long size) {
-    acquire_spinlock(&memlock);
-    int id=get_id(size);
-    size=BLOCK_SIZE[id];
-
-    if(!PowerHead[id]){
-        if(!PowerTail[id]){
-            PageHead* head=(PageHead*)kalloc_page();
+// call with kmem[id].lock
+static void new_slab(int id){
+    PageHead* h=kalloc_page();
+    u16 size=BLOCK_SIZE[id];
+    h->block_size=size;
+    h->id=id;
+    h->inuse=0;
+    h->free=sizeof(PageHead);
+    u16 off=sizeof(PageHead);
+    for(int i=1;i<kmem[id].objs;i++,off+=size)
+        *(u16*)((u64)h+off)=off+size;
+    *(u16*)((u64)h+off)=0;
+    partial_push(&kmem[id],h);
+    kmem[id].nr_empty++;
+    kmem[id].slabs++;
+}
 
-            // BlockPage[id]+=1;
-            // for(int i=0;i<BLOCK_TYPE;i++)printk("%lld ",BlockPage[i]);
-            // printk("\n");
+// move a batch of objects from the partial slabs into the CPU cache
+static void kmem_refill(int id,struct kmem_cpu* cc){
+    auto c=&kmem[id];
+    acquire_spinlock(&c->lock);
+    c->refills++;
+    while(cc->count<c->batch){
+        if(!c->partial)new_slab(id);
+        PageHead* h=pn_to_slab(c->partial);
+        if(h->inuse==0)c->nr_empty--;
+        while(h->free&&cc->count<c->batch){
+            QueueNode* obj=(QueueNode*)((u64)h+h->free);
+            h->free=*(u16*)obj;
+            h->inuse++;
+            obj->next=cc->head;
+            cc->head=obj;
+            cc->count++;
+        }
+        if(!h->free)partial_remove(c,h);
+    }
+    release_spinlock(&c->lock);
+}
 
-            head->block_size=size;
-            PowerTail[id]=(u64)head+sizeof(PageHead);
+// give a batch of objects in the CPU cache back to their slabs, and free
+// the slab pages that become empty beyond KMEM_KEEP_EMPTY
+static void kmem_flush(int id,struct kmem_cpu* cc){
+    auto c=&kmem[id];
+    acquire_spinlock(&c->lock);
+    c->flushes++;
+    for(int i=0;i<c->batch;i++){
+        QueueNode* obj=cc->head;
+        cc->head=obj->next;
+        cc->count--;
+        PageHead* h=(PageHead*)PAGE_BASE(obj);
+        if(!h->free)partial_push(c,h);
+        *(u16*)obj=h->free;
+        h->free=(u64)obj-(u64)h;
+        if(--h->inuse==0){
+            if(c->nr_empty>=KMEM_KEEP_EMPTY){
+                partial_remove(c,h);
+                c->slabs--;
+                kfree_page(h);
+            }
+            else c->nr_empty++;
         }
-        add_to_list(&PowerHead[id],(MyListNode*)PowerTail[id]);
-        if(PAGE_BASE((PowerTail[id]+2*size-1))!=PAGE_BASE(PowerTail[id]))PowerTail[id]=0;
-        else PowerTail[id]+=size;
     }
-    MyListNode *p=fetch_from_list(&PowerHead[id]);
-    release_spinlock(&memlock);
+    release_spinlock(&c->lock);
+}
+
+void* kalloc(unsigned long long size) {
+    int id=get_id(size);
+    // larger objects don't fit in a slab page, use kalloc_page instead
+    ASSERT(kmem[id].objs>0);
+    auto cc=&kmem_cpus[cpuid()].c[id];
+    if(!cc->head)kmem_refill(id,cc);
+    QueueNode* p=cc->head;
+    cc->head=p->next;
+    cc->count--;
+    cc->allocs++;
     return p;
 }
 
 void kfree(void* ptr) {
-    acquire_spinlock(&memlock);
     PageHead* head=(PageHead*)PAGE_BASE(ptr);
-    int id=get_id(head->block_size);
-    add_to_list(&PowerHead[id],(MyListNode*)ptr);
-    release_spinlock(&memlock);
-    return;
+    int id=head->id;
+    auto cc=&kmem_cpus[cpuid()].c[id];
+    QueueNode* p=ptr;
+    p->next=cc->head;
+    cc->head=p;
+    cc->frees++;
+    if(++cc->count>2*kmem[id].batch)kmem_flush(id,cc);
 }
 
+void kmem_report() {
+    printk("size\tslabs\tinuse\tallocs\trefills\tflushes\n");
+    for(int i=0;i<BLOCK_TYPE;i++){
+        u64 allocs=0,frees=0;
+        for(int j=0;j<NCPU;j++){
+            allocs+=kmem_cpus[j].c[i].allocs;
+            frees+=kmem_cpus[j].c[i].frees;
+        }
+        if(!allocs)continue;
+        printk("%d\t%lld\t%lld\t%lld\t%lld\t%lld\n",BLOCK_SIZE[i],
+               kmem[i].slabs,allocs-frees,allocs,kmem[i].refills,kmem[i].flushes);
+    }
+}
+
+// Every caller gets its own reference, which a mapping then owns.
 void* get_zero_page() {
+    increment_rc(&refpage[K2P(zero_page)/PAGE_SIZE].ref);
     return zero_page;
 }
@@ -8,6 +8,11 @@
 #define PAGE_COUNT ((P2K(PHYSTOP) - PAGE_BASE((u64) & end)) / PAGE_SIZE - 1)
 #define PAGE_TOTAL PHYSTOP/PAGE_SIZE
 
+// 2 MiB pages kept apart from the 4 KiB allocator at the top of RAM.
+#ifndef HUGE_PAGE_POOL
+#define HUGE_PAGE_POOL 64
+#endif
+
 struct page {
     RefCount ref;
 };
@@ -15,10 +20,25 @@ struct page {
 void kinit();
 u64 left_page_cnt();
 
+// NULL when memory is exhausted.
 WARN_RESULT void *kalloc_page();
 void kfree_page(void *);
+// pages are freed when their last reference is dropped by kfree_page.
+void *kshare_page(void *);
+isize page_refcount(void *);
+
+// NULL when the pool is empty, in which case the caller falls back to
+// 4 KiB pages.
+WARN_RESULT void *kalloc_huge_page();
+void kfree_huge_page(void *);
+void *kshare_huge_page(void *);
+// the block mappings of the page plus its 4 KiB pages still referenced on
+// their own. 1 means a block mapping holds it alone.
+isize huge_page_refcount(void *);
+u64 left_huge_page_cnt();
 
 WARN_RESULT void *kalloc(unsigned long long);
 void kfree(void *);
+void kmem_report();
 
 WARN_RESULT void *get_zero_page();
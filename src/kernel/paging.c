@@ -11,11 +11,105 @@
 #include <kernel/proc.h>
 #include <kernel/pt.h>
 #include <kernel/sched.h>
+#include <sys/mman.h>
 
+u64 region_begin(struct region *r) {
+    return r->vma?container_of(r,struct vma,region)->start:container_of(r,struct section,region)->begin;
+}
+
+u64 region_end(struct region *r) {
+    return r->vma?container_of(r,struct vma,region)->end:container_of(r,struct section,region)->end;
+}
+
+static bool region_cmp(rb_node lnode, rb_node rnode) {
+    auto l=container_of(lnode,struct region,rbnode);
+    auto r=container_of(rnode,struct region,rbnode);
+    u64 lb=region_begin(l),rb=region_begin(r);
+    return lb<rb||(lb==rb&&region_end(l)<region_end(r));
+}
+
+// add `r` to the index of `pd`. -1 if it overlaps a region already there.
+int region_insert(struct pgdir *pd, struct region *r) {
+    u64 begin=region_begin(r),end=region_end(r);
+    auto prev=region_lookup(pd,begin);
+    if(prev!=NULL&&region_end(prev)>begin)return -1;
+    if(_rb_insert(&r->rbnode,&pd->regions,region_cmp)!=0)return -1;
+    rb_node next=_rb_next(&r->rbnode);
+    if(next!=NULL&&region_begin(container_of(next,struct region,rbnode))<end){
+        _rb_erase(&r->rbnode,&pd->regions);
+        return -1;
+    }
+    return 0;
+}
+
+void region_erase(struct pgdir *pd, struct region *r) {
+    _rb_erase(&r->rbnode,&pd->regions);
+}
+
+// the region with the greatest begin not above `addr`. the caller checks
+// whether it reaches `addr`.
+static struct region* region_floor(struct pgdir *pd, u64 addr) {
+    struct region* res=NULL;
+    rb_node node=pd->regions.rb_node;
+    while(node){
+        auto r=container_of(node,struct region,rbnode);
+        if(region_begin(r)<=addr){
+            res=r;
+            node=node->rb_right;
+        }
+        else node=node->rb_left;
+    }
+    return res;
+}
+
+// the region that contains `addr`, or NULL.
+struct region *region_lookup(struct pgdir *pd, u64 addr) {
+    auto r=region_floor(pd,addr);
+    if(r==NULL||addr>=region_end(r))return NULL;
+    return r;
+}
+
+// the first region that ends above `addr`, or NULL.
+struct region *region_next(struct pgdir *pd, u64 addr) {
+    auto r=region_floor(pd,addr);
+    if(r!=NULL&&addr<region_end(r))return r;
+    rb_node node=r?_rb_next(&r->rbnode):_rb_first(&pd->regions);
+    return node?container_of(node,struct region,rbnode):NULL;
+}
+
+// the lowest `align`-aligned address from `from` on with `length` free
+// bytes after it, or 0 if there is none below the kernel. `align` is a power
+// of two, at least PAGE_SIZE.
+u64 region_find_gap(struct pgdir *pd, u64 from, u64 length, u64 align) {
+    u64 addr=(from+align-1)&~(align-1);
+    length=PAGE_BASE((length+PAGE_SIZE-1));
+    // start from the region right below `addr`, and go up to the first hole
+    // that is large enough.
+    auto r=region_floor(pd,addr);
+    rb_node node=r?&r->rbnode:_rb_first(&pd->regions);
+    for(;node;node=_rb_next(node)){
+        r=container_of(node,struct region,rbnode);
+        u64 begin=region_begin(r),end=region_end(r);
+        if(end<=addr||begin==end)continue;
+        if(addr+length<=PAGE_BASE(begin))break;
+        addr=(end+align-1)&~(align-1);
+    }
+    if(addr+length<addr||addr+length>KSPACE_MASK)return 0;
+    return addr;
+}
+
+// link `sec` into `pd`. -1 if it overlaps a section or mapping.
+int add_section(struct pgdir *pd, struct section *sec) {
+    sec->region.vma=false;
+    if(region_insert(pd,&sec->region)!=0)return -1;
+    _insert_into_list(&pd->section_head,&sec->stnode);
+    return 0;
+}
 
 void init_sections(ListNode *section_head) {
     /* (Final) TODO BEGIN */
     auto section=(struct section*)kalloc(sizeof(struct section));
+    memset(section,0,sizeof(struct section));
     _insert_into_list(section_head,&section->stnode);
     section->begin=section->end=0;
     section->flags=ST_HEAP;
@@ -28,6 +122,10 @@ void free_sections(struct pgdir *pd) {
         if(p==&pd->section_head)break;
         struct section* sec=container_of(p,struct section,stnode);
         for(u64 i=PAGE_BASE(sec->begin);i<sec->end;i+=PAGE_SIZE){
+            if(vmunmap_huge(pd,i,sec->end)){
+                i+=HUGE_PAGE_SIZE-PAGE_SIZE;
+                continue;
+            }
             auto pte=get_pte(pd,i,false);
             if(pte&&(*pte&PTE_VALID))kfree_page((void*)P2K(PTE_ADDRESS(*pte)));
         }
@@ -37,6 +135,7 @@ void free_sections(struct pgdir *pd) {
 
         p=p->next;
         _detach_from_list(&sec->stnode);
+        region_erase(pd,&sec->region);
         kfree(sec);
     }
     /* (Final) TODO END */
@@ -70,25 +169,110 @@ u64 sbrk(i64 size) {
     sec->end+=size;
     if(size<0){
         for(u64 i=0;i<(u64)-size;i+=PAGE_SIZE){
+            if(vmunmap_huge(pd,sec->end+i,res)){
+                i+=HUGE_PAGE_SIZE-PAGE_SIZE;
+                continue;
+            }
             auto pte=get_pte(pd,sec->end+i,false);
-            if(pte&&*pte){
-                kfree_page((void*)P2K((*pte)&KSPACE_MASK));
+            if(pte&&(*pte&PTE_VALID)){
+                kfree_page((void*)P2K(PTE_ADDRESS(*pte)));
                 *pte=NULL;
             }
         }
+        flush_tlb_pgdir(pd);
     }
-    arch_tlbi_vmalle1is();
     return res;
     /* (Final) TODO END */
 }
 
-int pgfault_handler(u64 iss) {
-    // printk("pgfault_handler\n");
-    Proc *p = thisproc();
-    ASSERT(p!=NULL);
-    struct pgdir *pd = &p->pgdir;
-    u64 addr = arch_get_far(); // Attempting to access this address caused the page fault
+// data abort ISS: the fault was caused by a store.
+#define ISS_WNR (1 << 6)
+
+// fault in page `va` of the file-backed section `sec`. a page that holds
+// only file content is the page cache frame itself, mapped read-only, so
+// every process running the same binary shares it and a store to a data
+// page copies it. other pages are filled from the file and zeroed past the
+// file part of the section.
+static int section_fault(struct pgdir* pd,struct section* sec,u64 va){
+    Inode* ip=sec->fp->ip;
+    bool ro=sec->flags&ST_RO;
+    u64 fend=sec->begin+sec->length;
+    if(va<fend&&sec->offset+va>=sec->begin&&(sec->offset+va-sec->begin)%PAGE_SIZE==0
+       &&(ro||va+PAGE_SIZE<=fend)){
+        inodes.lock(ip);
+        CachedPage* cp=inodes.get_page(ip,(sec->offset+va-sec->begin)/PAGE_SIZE);
+        vmmap(pd,va,kshare_page(cp->data),PTE_USER_DATA|PTE_RO);
+        inodes.put_page(cp);
+        inodes.unlock(ip);
+    }
+    else{
+        void* p=kalloc_page();
+        memset(p,0,PAGE_SIZE);
+        u64 l=MAX(va,sec->begin),r=MIN(va+PAGE_SIZE,fend);
+        if(l<r){
+            inodes.lock(ip);
+            inodes.read(ip,(u8*)p+(l-va),sec->offset+(l-sec->begin),r-l);
+            inodes.unlock(ip);
+        }
+        vmmap(pd,va,p,ro?PTE_USER_DATA|PTE_RO:PTE_USER_DATA);
+    }
+    flush_tlb_page(pd,va);
+    return 0;
+}
+
+bool huge_page_enabled=true;
+
+// fault in a page of anonymous memory with `flags`, or copy it on write.
+// a 2 MiB page is mapped instead if [begin, end) holds the whole block
+// around `addr`, nothing in the block is mapped yet, and the pool has one.
+static int anon_fault(struct pgdir* pd,u64 addr,u64 begin,u64 end,u64 flags){
+    u64 base=HUGE_PAGE_BASE(addr);
+    auto pmd=get_block_pte(pd,addr,false);
+    if(pmd!=NULL&&PTE_IS_BLOCK(*pmd)){
+        // a store to a block shared since fork. if the others are gone it
+        // is ours, otherwise get_pte splits it and the page is copied.
+        if(huge_page_refcount((void*)P2K(PTE_ADDRESS(*pmd)))==1){
+            *pmd&=~PTE_RO;
+            flush_tlb_page(pd,base);
+            return 0;
+        }
+    }
+    else if(huge_page_enabled&&begin<=base&&base+HUGE_PAGE_SIZE<=end
+            &&(pmd==NULL||!(*pmd&PTE_VALID))){
+        void* p=kalloc_huge_page();
+        if(p!=NULL){
+            memset(p,0,HUGE_PAGE_SIZE);
+            vmmap_huge(pd,base,p,flags);
+            flush_tlb_page(pd,base);
+            return 0;
+        }
+    }
 
+    auto pte = get_pte(pd,addr,true);
+    if (*pte == NULL){
+        void* p = kalloc_page();
+        memset(p, 0, PAGE_SIZE);
+        vmmap(pd,addr,p,flags);
+    }
+    else if (PTE_FLAGS(*pte) & PTE_RO){
+        // copy on write, unless nobody else holds the page any more.
+        void* old = (void *)P2K(PTE_ADDRESS(*pte));
+        if (page_refcount(old) == 1){
+            *pte &= ~PTE_RO;
+        }
+        else{
+            auto p = kalloc_page();
+            memcpy(p, old, PAGE_SIZE);
+            kfree_page(old);
+            vmmap(pd,addr,p,flags);
+        }
+    }
+    flush_tlb_page(pd,addr);
+    return 0;
+}
+
+// handle a fault at `addr` of `pd`, a store if `iss` has ISS_WNR.
+static int handle_fault(struct pgdir *pd, u64 addr, u64 iss) {
     /** 
      * (Final) TODO BEGIN
      * 
@@ -101,54 +285,121 @@ int pgfault_handler(u64 iss) {
     // printk("pagefault:%llx\n",(u64)addr);
     if(addr&KSPACE_MASK)PANIC();
 
-    if(!_empty_list(&p->vma_head)){
-        struct vma* vma=NULL;
-        _for_in_list(node,&p->vma_head){
-            if(node==&p->vma_head)break;
-            auto v=container_of(node,struct vma,ptnode);
-            if(v->start<=addr&&addr<v->end){vma=v;break;}
+    auto region=region_lookup(pd,addr);
+    if(region!=NULL&&region->vma){
+        struct vma* vma=container_of(region,struct vma,region);
+        if(vma->file==NULL){
+            if((iss&ISS_WNR)&&(vma->permission&PTE_RO))return -1;
+            return anon_fault(pd,addr,vma->start,vma->end,vma->permission);
         }
-        if(vma){
-            addr=PAGE_BASE(addr);
-            void* page=kalloc_page();
-            vmmap(pd,addr,page,vma->permission);
-            arch_tlbi_vmalle1is();
-            struct file *f = vma->file;
-            if(!f->readable||f->type!=FD_INODE)return -1;
-            inodes.lock(f->ip);
-            inodes.read(f->ip,(u8*)page,vma->off+(addr-vma->start),PAGE_SIZE);
-            inodes.unlock(f->ip);
+        addr=PAGE_BASE(addr);
+        struct file *f = vma->file;
+        if(!f->readable||f->type!=FD_INODE)return -1;
+        bool shared=!(vma->flags&MAP_PRIVATE);
+        bool write=iss&ISS_WNR;
+        auto pte=get_pte(pd,addr,false);
+        if(pte!=NULL&&(*pte&PTE_VALID)){
+            if(!write||(vma->permission&PTE_RO))return -1;
+            // a private page still shared with the other side of a fork.
+            if(!shared)return anon_fault(pd,addr,0,0,vma->permission);
+            // the first store to a clean page of a shared mapping.
+            *pte=(*pte&~PTE_RO)|PTE_DIRTY;
+            flush_tlb_page(pd,addr);
             return 0;
         }
+        // writable shared pages start clean and read-only, unless this
+        // very fault is a store.
+        u64 flags=vma->permission;
+        if(shared&&!(flags&PTE_RO))flags|=write?PTE_DIRTY:PTE_RO;
+        usize off=vma->off+(addr-vma->start);
+        inodes.lock(f->ip);
+        if(off%PAGE_SIZE==0&&f->ip->entry.type==INODE_REGULAR){
+            // map the frame of the page cache itself, unless a private
+            // mapping could write to it. shared mappings keep the page
+            // pinned until they unmap it, so that every process finds
+            // the same frame.
+            CachedPage* cp=inodes.get_page(f->ip,off/PAGE_SIZE);
+            if(!shared&&!(vma->permission&PTE_RO)){
+                void* page=kalloc_page();
+                memcpy(page,cp->data,PAGE_SIZE);
+                vmmap(pd,addr,page,flags);
+                inodes.put_page(cp);
+            }
+            else{
+                vmmap(pd,addr,kshare_page(cp->data),flags);
+                if(!shared)inodes.put_page(cp);
+            }
+        }
+        else{
+            void* page=kalloc_page();
+            memset(page,0,PAGE_SIZE);
+            if(off<f->ip->entry.num_bytes)
+                inodes.read(f->ip,(u8*)page,off,PAGE_SIZE);
+            vmmap(pd,addr,page,flags);
+        }
+        inodes.unlock(f->ip);
+        flush_tlb_page(pd,addr);
+        return 0;
     }
 
-    auto pte = get_pte(pd,addr,true);
-    if (*pte == NULL){
-        vmmap(pd,addr,kalloc_page(),PTE_USER_DATA);
-    }
-    else if (PTE_FLAGS(*pte) & PTE_RO){
-        auto p = kalloc_page();
-        memcpy(p, (void *)P2K(PTE_ADDRESS(*pte)), PAGE_SIZE);
-        kfree_page((void *)P2K(PTE_ADDRESS(*pte)));
-        vmmap(pd,addr,p,PTE_USER_DATA);
+    // the heap may get 2 MiB pages, the stack and the data of binaries not.
+    u64 begin=0,end=0;
+    if(region!=NULL){
+        auto sec=container_of(region,struct section,region);
+        if(sec->fp!=NULL){
+            auto pte=get_pte(pd,addr,false);
+            if(pte==NULL||!(*pte&PTE_VALID))return section_fault(pd,sec,PAGE_BASE(addr));
+            // text is never written; data goes on to copy on write.
+            if((sec->flags&ST_RO)&&(iss&ISS_WNR))return -1;
+        }
+        if(sec->flags&ST_HEAP){
+            begin=sec->begin;
+            end=sec->end;
+        }
     }
-    arch_tlbi_vmalle1is();
-    return 0;
-
+    return anon_fault(pd,addr,begin,end,PTE_USER_DATA);
 
     /* (Final) TODO END */
 }
 
-void copy_sections(ListNode *from_head, ListNode *to_head)
+int pgfault_handler(u64 iss) {
+    // printk("pgfault_handler\n");
+    Proc *p = thisproc();
+    ASSERT(p!=NULL);
+    u64 addr = arch_get_far(); // Attempting to access this address caused the page fault
+    return handle_fault(&p->pgdir,addr,iss);
+}
+
+// fault in every page of [begin, end) that a kernel access would fault on:
+// the handler may sleep on the inode lock and on the disk, so the kernel
+// must not take that fault while it holds a spinlock or an inode lock.
+// -1 if a page cannot be faulted in.
+int populate_user(u64 begin, u64 end, bool write) {
+    auto pd=&thisproc()->pgdir;
+    for(u64 va=PAGE_BASE(begin);va<end;va+=PAGE_SIZE){
+        auto pmd=get_block_pte(pd,va,false);
+        PTEntry e=0;
+        if(pmd!=NULL&&PTE_IS_BLOCK(*pmd))e=*pmd;
+        else{
+            auto pte=get_pte(pd,va,false);
+            if(pte!=NULL)e=*pte;
+        }
+        if((e&PTE_VALID)&&(!write||!(e&PTE_RO)))continue;
+        if(handle_fault(pd,va,write?ISS_WNR:0)<0)return -1;
+    }
+    return 0;
+}
+
+void copy_sections(struct pgdir *from, struct pgdir *to)
 {
     /* (Final) TODO BEGIN */
-    _for_in_list(p, from_head){
-		if(p == from_head)break;
+    _for_in_list(p, &from->section_head){
+		if(p == &from->section_head)break;
 		struct section* sec = container_of(p, struct section, stnode);
 		struct section* new_sec = kalloc(sizeof(struct section));
 		memmove(new_sec, sec, sizeof(struct section));
 		if(sec->fp)new_sec->fp = file_dup(sec->fp);
-		_insert_into_list(to_head, &new_sec->stnode);
+		if(add_section(to, new_sec)!=0)PANIC();
 	}
 
     /* (Final) TODO END */
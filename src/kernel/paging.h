@@ -18,6 +18,7 @@ struct section {
     u64 begin;
     u64 end;
     ListNode stnode;
+    struct region region;
 
     /* The following fields are for the file-backed sections. */
 
@@ -27,7 +28,17 @@ struct section {
 };
 
 int pgfault_handler(u64 iss);
+WARN_RESULT int populate_user(u64 begin, u64 end, bool write);
 void init_sections(ListNode *section_head);
 void free_sections(struct pgdir *pd);
-void copy_sections(ListNode *from_head, ListNode *to_head);
+void copy_sections(struct pgdir *from, struct pgdir *to);
+WARN_RESULT int add_section(struct pgdir *pd, struct section *sec);
+
+WARN_RESULT int region_insert(struct pgdir *pd, struct region *r);
+void region_erase(struct pgdir *pd, struct region *r);
+WARN_RESULT struct region *region_lookup(struct pgdir *pd, u64 addr);
+WARN_RESULT struct region *region_next(struct pgdir *pd, u64 addr);
+u64 region_begin(struct region *r);
+u64 region_end(struct region *r);
+WARN_RESULT u64 region_find_gap(struct pgdir *pd, u64 from, u64 length, u64 align);
 u64 sbrk(i64 size);
@@ -142,13 +142,11 @@ int wait(int *exitcode)
     if(!wait_sem(&this->childexit))return -1;
 
     acquire_spinlock(&proclock);
-    acquire_sched_lock();
     _for_in_list(p,&this->children){
         if(p==&this->children)break;
         Proc* childproc=container_of(p,struct Proc,ptnode); 
-        if(childproc->state==ZOMBIE){
+        if(is_zombie(childproc)){
             _detach_from_list(&childproc->ptnode);
-            _detach_from_list(&childproc->schinfo.ptnode);
 
             *exitcode=childproc->exitcode;
             kfree_page(childproc->kstack);
@@ -156,28 +154,87 @@ int wait(int *exitcode)
             kfree(childproc);
             free_pid(pid);
 
-            release_sched_lock();
             release_spinlock(&proclock);
 
             return pid;
         }
     }
-    release_sched_lock();
     release_spinlock(&proclock);
     return -1;
 }
 
-void vma_writeback(struct vma* vma,usize length){
-    if(vma->permission&PTE_RO||(vma->flags&MAP_PRIVATE))return;
-    for(u64 i=0;i<length;i+=PAGE_SIZE){
-        volatile char data=*(char*)((u64)vma->start+i);
-        (void)data;
+void vma_writeback(struct vma* vma,u64 begin,u64 end){
+    if(vma->file==NULL||vma->permission&PTE_RO||(vma->flags&MAP_PRIVATE))return;
+    auto pd=&thisproc()->pgdir;
+    auto ip=vma->file->ip;
+    for(u64 va=PAGE_BASE(begin);va<end;va+=PAGE_SIZE){
+        auto pte=get_pte(pd,va,false);
+        if(pte==NULL||!(*pte&PTE_VALID)||!(*pte&PTE_DIRTY))continue;
+        // write from the frame itself, never past the end of the file.
+        usize off=vma->off+(va-vma->start);
+        OpContext ctx;
+        bcache.begin_op(&ctx);
+        inodes.lock(ip);
+        if(off<ip->entry.num_bytes){
+            usize n=MIN((usize)PAGE_SIZE,ip->entry.num_bytes-off);
+            inodes.write(&ctx,ip,(u8*)P2K(PTE_ADDRESS(*pte)),off,n);
+        }
+        inodes.unlock(ip);
+        bcache.end_op(&ctx);
+        // the next store marks it dirty again.
+        *pte=(*pte&~PTE_DIRTY)|PTE_RO;
+        flush_tlb_page(pd,va);
+    }
+}
+
+void vma_unmap(struct vma* vma,u64 begin,u64 end){
+    auto pd=&thisproc()->pgdir;
+    auto ip=vma->file?vma->file->ip:NULL;
+    vma_writeback(vma,begin,end);
+    for(u64 va=PAGE_BASE(begin);va<end;va+=PAGE_SIZE){
+        // a 2 MiB page of anonymous memory goes at once, unless only part
+        // of it does, and get_pte splits it.
+        if(vmunmap_huge(pd,va,end)){
+            flush_tlb_page(pd,va);
+            va+=HUGE_PAGE_SIZE-PAGE_SIZE;
+            continue;
+        }
+        auto pte=get_pte(pd,va,false);
+        if(pte==NULL||!(*pte&PTE_VALID))continue;
+        usize off=vma->off+(va-vma->start);
+        if(ip&&!(vma->flags&MAP_PRIVATE)&&off%PAGE_SIZE==0&&ip->entry.type==INODE_REGULAR){
+            // drop the pin the fault took on the page cache frame.
+            inodes.lock(ip);
+            CachedPage* page=inodes.get_page(ip,off/PAGE_SIZE);
+            if(page->data==(u8*)P2K(PTE_ADDRESS(*pte)))inodes.put_page(page);
+            inodes.put_page(page);
+            inodes.unlock(ip);
+        }
+        vmunmap(pd,va);
+        flush_tlb_page(pd,va);
+    }
+}
+
+int vma_add(Proc* p,struct vma* vma){
+    vma->region.vma=true;
+    if(region_insert(&p->pgdir,&vma->region)!=0)return -1;
+    _insert_into_list(&p->vma_head,&vma->ptnode);
+    return 0;
+}
+
+void vma_remove(Proc* p,struct vma* vma){
+    region_erase(&p->pgdir,&vma->region);
+    _detach_from_list(&vma->ptnode);
+    if(vma->file)file_close(vma->file);
+    kfree(vma);
+}
+
+void free_vmas(Proc* p){
+    while(!_empty_list(&p->vma_head)){
+        auto vma=container_of(p->vma_head.next,struct vma,ptnode);
+        vma_unmap(vma,vma->start,vma->end);
+        vma_remove(p,vma);
     }
-    auto f=vma->file;
-    auto f_off=f->off;
-    f->off=vma->off;
-    file_write(f,(char*)vma->start,length);
-    f->off=f_off;
 }
 
 NO_RETURN void exit(int code)
@@ -189,10 +246,13 @@ NO_RETURN void exit(int code)
     // 4. sched(ZOMBIE)
     // NOTE: be careful of concurrency
 
+    Proc* this=thisproc();
+    // writing mappings back sleeps, so it happens before taking the locks.
+    free_vmas(this);
+
     acquire_spinlock(&proclock);
     acquire_sched_lock();
 
-    Proc* this=thisproc();
     this->exitcode=code;
     if(!_empty_list(&this->children)){
         _for_in_list(p,&this->children){
@@ -204,20 +264,6 @@ NO_RETURN void exit(int code)
         _detach_from_list(&this->children);        
     }
 
-    for(ListNode* p=this->vma_head.next;p!=&this->vma_head;){
-        auto vma=container_of(p,struct vma,ptnode);
-        vma_writeback(vma,vma->length);
-        for(u64 i=0;i<vma->length;i+=PAGE_SIZE){
-            vmunmap(&this->pgdir,vma->start+i);
-        }
-        arch_tlbi_vmalle1is();
-        file_close(vma->file);
-
-        auto q=p->next;
-        kfree(vma);
-        p=q;
-    }
-
     release_sched_lock();
     release_spinlock(&proclock);
     for(int i=0;i<NOFILE;i++){
@@ -272,6 +318,32 @@ int kill(int pid)
     return -1;
 }
 
+int setnice(int pid, int nice)
+{
+    acquire_spinlock(&proclock);
+    Proc* p=find_proc(pid,&root_proc);
+    if(p!=NULL&&!is_unused(p)){
+        sched_set_nice(p,nice);
+        release_spinlock(&proclock);
+        return 0;
+    }
+    release_spinlock(&proclock);
+    return -1;
+}
+
+int getnice(int pid, int *nice)
+{
+    acquire_spinlock(&proclock);
+    Proc* p=find_proc(pid,&root_proc);
+    if(p!=NULL&&!is_unused(p)){
+        *nice=sched_get_nice(p);
+        release_spinlock(&proclock);
+        return 0;
+    }
+    release_spinlock(&proclock);
+    return -1;
+}
+
 /*
  * Create a new process copying p as the parent.
  * Sets up stack to return as if from system call.
@@ -286,6 +358,25 @@ void print_oftable(struct oftable* oftable){
         }
     }  
 }
+// give `son` the pages of `fat` in [begin, end). with `cow`, both sides
+// share the frames read-only, and the first write fault of either side
+// copies the page.
+static void share_pages(Proc* fat,Proc* son,u64 begin,u64 end,bool cow){
+    for(u64 va=PAGE_BASE(begin);va<end;va+=PAGE_SIZE){
+        auto oldpmd=get_block_pte(&fat->pgdir,va,false);
+        if(oldpmd!=NULL&&PTE_IS_BLOCK(*oldpmd)){
+            if(cow)*oldpmd|=PTE_RO;
+            vmmap_huge(&son->pgdir,va,kshare_huge_page((void*)P2K(PTE_ADDRESS(*oldpmd))),PTE_FLAGS(*oldpmd));
+            va+=HUGE_PAGE_SIZE-PAGE_SIZE;
+            continue;
+        }
+        auto oldpte=get_pte(&fat->pgdir,va,false);
+        if(oldpte==NULL||!(*oldpte&PTE_VALID))continue;
+        if(cow)*oldpte|=PTE_RO;
+        vmmap(&son->pgdir,va,kshare_page((void*)P2K(PTE_ADDRESS(*oldpte))),PTE_FLAGS(*oldpte));
+    }
+}
+
 int fork()
 {
     /**
@@ -303,6 +394,7 @@ int fork()
     Proc *son=create_proc();
 
     set_parent_to_this(son);
+    sched_set_nice(son,sched_get_nice(fat));
 
     for (int i = 0; i < NOFILE; i++){
         if(fat->oftable.file[i]){
@@ -315,17 +407,9 @@ int fork()
         if(p==&fat->pgdir.section_head)break;
 
         struct section* sec=container_of(p,struct section,stnode);
-        for(u64 va=PAGE_BASE(sec->begin);va<sec->end;va+=PAGE_SIZE){
-            auto oldpte=get_pte(&fat->pgdir,va,false);
-            if(oldpte==NULL||!(*oldpte&PTE_VALID))continue;
-            // vmmap(&son->pgdir,va,(void*)P2K(PTE_ADDRESS(*oldpte)),PTE_FLAGS(*oldpte)|PTE_RO);
-            void* np=kalloc_page();
-            vmmap(&son->pgdir, va, np, PTE_FLAGS(*oldpte));
-            copyout(&son->pgdir, (void*)va, (void*)P2K(PTE_ADDRESS(*oldpte)), PAGE_SIZE);
-            
-        }
+        share_pages(fat,son,sec->begin,sec->end,true);
     }
-    copy_sections(&fat->pgdir.section_head,&son->pgdir.section_head);
+    copy_sections(&fat->pgdir,&son->pgdir);
     memmove(son->ucontext,fat->ucontext,sizeof(UserContext));
 
     son->ucontext->x[0]=0;
@@ -335,9 +419,15 @@ int fork()
         auto v=container_of(p,struct vma,ptnode);
         struct vma* nv=kalloc(sizeof(struct vma));
         memmove(nv,v,sizeof(struct vma));
-        nv->file=file_dup(v->file);
-        _insert_into_list(&son->vma_head,&nv->ptnode);
+        if(v->file)nv->file=file_dup(v->file);
+        // anonymous memory has no file to fault back in from, and private
+        // file pages may hold stores the file never saw. shared file pages
+        // fault back in from the page cache.
+        if(v->file==NULL)share_pages(fat,son,v->start,v->end,v->flags&MAP_PRIVATE);
+        else if(v->flags&MAP_PRIVATE)share_pages(fat,son,v->start,v->end,true);
+        if(vma_add(son,nv)!=0)PANIC();
     }
+    flush_tlb_pgdir(&fat->pgdir);
 
     return start_proc(son,trap_return,0);
     /* (Final) TODO END */
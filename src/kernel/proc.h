@@ -30,7 +30,12 @@ typedef struct KernelContext {
 // embeded data for procs
 struct schinfo {
     // TODO: customize your sched info
-    ListNode ptnode;
+    struct rb_node_ rbnode;
+    int cpu;
+    int nice;
+    u32 weight;
+    u64 vruntime;
+    u64 exec_start;
 };
 
 struct vma{
@@ -39,9 +44,13 @@ struct vma{
     int flags;
     struct file* file;
     ListNode ptnode;
+    struct region region;
 };
 
-void vma_writeback(struct vma* vma,usize length);
+// write the dirty pages of a shared mapping in [begin, end) back to its file.
+void vma_writeback(struct vma* vma,u64 begin,u64 end);
+// write back and unmap [begin, end) of a mapping.
+void vma_unmap(struct vma* vma,u64 begin,u64 end);
 
 typedef struct Proc {
     bool killed;
@@ -70,4 +79,12 @@ int start_proc(Proc *, void (*entry)(u64), u64 arg);
 NO_RETURN void exit(int code);
 WARN_RESULT int wait(int *exitcode);
 WARN_RESULT int kill(int pid);
+// link a new mapping into `p`. -1 if it overlaps a section or mapping.
+WARN_RESULT int vma_add(Proc *p, struct vma *vma);
+// unlink and free a mapping that is already unmapped.
+void vma_remove(Proc *p, struct vma *vma);
+// unmap and free all mappings of `p`.
+void free_vmas(Proc *p);
+WARN_RESULT int setnice(int pid, int nice);
+WARN_RESULT int getnice(int pid, int *nice);
 WARN_RESULT int fork();
\ No newline at end of file
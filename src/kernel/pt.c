@@ -1,11 +1,12 @@
 #include <aarch64/intrinsic.h>
+#include <common/bitmap.h>
 #include <common/string.h>
+#include <kernel/cpu.h>
 #include <kernel/mem.h>
 #include <kernel/pt.h>
 
 #include <kernel/printk.h>
 
-extern struct page refpage[PAGE_TOTAL];
 
 static void* fetch_page(){
     void* p=kalloc_page();
@@ -13,14 +14,9 @@ static void* fetch_page(){
     return p;
 }
 
-PTEntriesPtr get_pte(struct pgdir *pgdir, u64 va, bool alloc)
+PTEntriesPtr get_block_pte(struct pgdir *pgdir, u64 va, bool alloc)
 {
-    // TODO:
-    // Return a pointer to the PTE (Page Table Entry) for virtual address 'va'
-    // If the entry not exists (NEEDN'T BE VALID), allocate it if alloc=true, or return NULL if false.
-    // THIS ROUTINUE GETS THE PTE, NOT THE PAGE DESCRIBED BY PTE.
-
-    PTEntriesPtr p0=pgdir->pt,p1,p2,p3;
+    PTEntriesPtr p0=pgdir->pt,p1,p2;
     if(p0==NULL){
         if(!alloc)return NULL;
         pgdir->pt=p0=fetch_page();
@@ -35,17 +31,53 @@ PTEntriesPtr get_pte(struct pgdir *pgdir, u64 va, bool alloc)
         p1[VA_PART1(va)]=K2P(fetch_page())|PTE_TABLE;
     }
     p2=(PTEntriesPtr)P2K(PTE_ADDRESS(p1[VA_PART1(va)]));
-    if (!(p2[VA_PART2(va)]&PTE_VALID)){
+    return &p2[VA_PART2(va)];
+}
+
+// replace the block entry `pmd` of the 2 MiB page around `va` by a table of
+// page entries with the same flags. each 4 KiB page takes a reference of its
+// own, and the block's reference is dropped.
+static void split_block(struct pgdir *pd, u64 va, PTEntriesPtr pmd)
+{
+    PTEntry block=*pmd;
+    u64 pa=PTE_ADDRESS(block);
+    PTEntriesPtr p3=fetch_page();
+    for(int i=0;i<N_PTE_PER_TABLE;i++){
+        kshare_page((void*)P2K(pa+i*PAGE_SIZE));
+        p3[i]=(pa+i*PAGE_SIZE)|PTE_FLAGS(block)|PTE_PAGE;
+    }
+    // break before make: the block has to leave the TLB before the table
+    // takes its place.
+    *pmd=NULL;
+    flush_tlb_page(pd,HUGE_PAGE_BASE(va));
+    *pmd=K2P(p3)|PTE_TABLE;
+    kfree_huge_page((void*)P2K(pa));
+}
+
+PTEntriesPtr get_pte(struct pgdir *pgdir, u64 va, bool alloc)
+{
+    // TODO:
+    // Return a pointer to the PTE (Page Table Entry) for virtual address 'va'
+    // If the entry not exists (NEEDN'T BE VALID), allocate it if alloc=true, or return NULL if false.
+    // THIS ROUTINUE GETS THE PTE, NOT THE PAGE DESCRIBED BY PTE.
+
+    // a 2 MiB block on the way is split, as the caller wants one page of it.
+    PTEntriesPtr p2=get_block_pte(pgdir,va,alloc),p3;
+    if(p2==NULL)return NULL;
+    if(PTE_IS_BLOCK(*p2))split_block(pgdir,va,p2);
+    else if (!(*p2&PTE_VALID)){
         if (!alloc) return NULL;
-        p2[VA_PART2(va)]=K2P(fetch_page())|PTE_TABLE;
+        *p2=K2P(fetch_page())|PTE_TABLE;
     }
-    p3=(PTEntriesPtr)P2K(PTE_ADDRESS(p2[VA_PART2(va)]));
+    p3=(PTEntriesPtr)P2K(PTE_ADDRESS(*p2));
     return &p3[VA_PART3(va)];
 }
 
 void init_pgdir(struct pgdir *pgdir)
 {
     pgdir->pt = NULL;
+    pgdir->asid = 0;
+    pgdir->regions.rb_node = NULL;
     init_spinlock(&pgdir->lock);
     init_list_node(&pgdir->section_head);
 }
@@ -57,7 +89,9 @@ static void free_page(PTEntriesPtr p,int dep){
     }
     for(int i=0;i<N_PTE_PER_TABLE;i++){
         if(p[i]!=NULL){
-            free_page((PTEntriesPtr)P2K(PTE_ADDRESS(p[i])),dep+1);
+            // a block entry maps a page, it is no table.
+            if(dep!=2||!PTE_IS_BLOCK(p[i]))
+                free_page((PTEntriesPtr)P2K(PTE_ADDRESS(p[i])),dep+1);
             p[i]=NULL;
         }
     }
@@ -75,36 +109,144 @@ void free_pgdir(struct pgdir *pgdir)
     pgdir->pt=NULL;
 }
 
+// ASIDs are handed out in generations. When a generation runs out, the
+// whole TLB is flushed once and a new generation starts, keeping the ASIDs
+// that are running on some CPU right now. ASID 0 is never given to a user
+// address space. With `asid_enabled` off, every switch flushes the TLB as
+// it used to.
+#define ASID_BITS 8
+#define NUM_ASIDS (1 << ASID_BITS)
+#define ASID_MASK (NUM_ASIDS - 1)
+
+bool asid_enabled=true;
+
+static SpinLock asid_lock;
+static u64 asid_generation=NUM_ASIDS;
+static Bitmap(asid_map,NUM_ASIDS);
+static usize asid_cursor=1;
+static u64 active_asid[NCPU],reserved_asid[NCPU];
+
+static void asid_rollover(){
+    asid_generation+=NUM_ASIDS;
+    memset(asid_map,0,sizeof(asid_map));
+    bitmap_set(asid_map,0);
+    for(int i=0;i<NCPU;i++){
+        u64 asid=active_asid[i]?active_asid[i]:reserved_asid[i];
+        reserved_asid[i]=asid;
+        bitmap_set(asid_map,asid&ASID_MASK);
+    }
+    asid_cursor=1;
+    arch_tlbi_vmalle1is();
+}
+
+// find an ASID of the current generation for `pgdir`. call with `asid_lock`.
+static u64 asid_new_context(struct pgdir *pgdir){
+    u64 asid=pgdir->asid;
+    if(asid!=0){
+        // it was running somewhere across the rollover, so it keeps its
+        // number, as it does if nobody has taken it since.
+        for(int i=0;i<NCPU;i++){
+            if(reserved_asid[i]==asid){
+                asid=asid_generation|(asid&ASID_MASK);
+                reserved_asid[i]=asid;
+                return asid;
+            }
+        }
+        if(!bitmap_get(asid_map,asid&ASID_MASK)){
+            bitmap_set(asid_map,asid&ASID_MASK);
+            return asid_generation|(asid&ASID_MASK);
+        }
+    }
+    while(asid_cursor<NUM_ASIDS&&bitmap_get(asid_map,asid_cursor))asid_cursor++;
+    if(asid_cursor==NUM_ASIDS){
+        asid_rollover();
+        while(bitmap_get(asid_map,asid_cursor))asid_cursor++;
+    }
+    bitmap_set(asid_map,asid_cursor);
+    return asid_generation|asid_cursor;
+}
+
 void attach_pgdir(struct pgdir *pgdir)
 {
     extern PTEntries invalid_pt;
-    if (pgdir->pt)
-        arch_set_ttbr0(K2P(pgdir->pt));
-    else
+    if (pgdir->pt == NULL) {
         arch_set_ttbr0(K2P(&invalid_pt));
+        return;
+    }
+    if (!asid_enabled) {
+        arch_set_ttbr0(K2P(pgdir->pt));
+        arch_tlbi_vmalle1is();
+        return;
+    }
+    acquire_spinlock(&asid_lock);
+    if ((pgdir->asid & ~(u64)ASID_MASK) != asid_generation)
+        pgdir->asid = asid_new_context(pgdir);
+    active_asid[cpuid()] = pgdir->asid;
+    release_spinlock(&asid_lock);
+    arch_set_ttbr0(K2P(pgdir->pt) | (pgdir->asid & ASID_MASK) << 48);
+}
+
+void flush_tlb_page(struct pgdir *pd, u64 va)
+{
+    if (!asid_enabled)
+        arch_tlbi_vmalle1is();
+    else if (pd->asid != 0)
+        arch_tlbi_vae1is(pd->asid & ASID_MASK, va);
+}
+
+void flush_tlb_pgdir(struct pgdir *pd)
+{
+    if (!asid_enabled)
+        arch_tlbi_vmalle1is();
+    else if (pd->asid != 0)
+        arch_tlbi_aside1is(pd->asid & ASID_MASK);
 }
 
 /**
  * Map virtual address 'va' to the physical address represented by kernel
  * address 'ka' in page directory 'pd', 'flags' is the flags for the page
- * table entry.
+ * table entry. The mapping takes over one reference to the page from the
+ * caller, and vmunmap drops it.
  */
 void vmmap(struct pgdir *pd, u64 va, void *ka, u64 flags)
 {
     /* (Final) TODO BEGIN */
     auto pte=get_pte(pd,va,true);
     *pte=K2P(ka)|flags;
-    increment_rc(&refpage[K2P(ka)/PAGE_SIZE].ref);
     /* (Final) TODO END */
 }
 
 void vmunmap(struct pgdir *pd, u64 va){
     auto pte=get_pte(pd,va,false);
-    if(pte==NULL)return;
-    decrement_rc(&refpage[PTE_ADDRESS(*pte)/PAGE_SIZE].ref);
+    if(pte==NULL||!(*pte&PTE_VALID))return;
+    kfree_page((void*)P2K(PTE_ADDRESS(*pte)));
     *pte=NULL;
 }
 
+/**
+ * Map the 2 MiB page at 'ka' at 'va', both 2 MiB aligned, with a block entry.
+ * Nothing may be mapped in that range yet. The mapping takes over one
+ * reference to the page, as vmmap does.
+ */
+void vmmap_huge(struct pgdir *pd, u64 va, void *ka, u64 flags)
+{
+    auto pmd=get_block_pte(pd,va,true);
+    ASSERT(!(*pmd&PTE_VALID));
+    *pmd=K2P(ka)|(flags&~(u64)PTE_PAGE)|PTE_BLOCK;
+}
+
+// unmap the block at 'va' if it lies within [va, end). false if there is
+// no such block, e.g. because only part of it is to go.
+bool vmunmap_huge(struct pgdir *pd, u64 va, u64 end)
+{
+    auto pmd=get_block_pte(pd,va,false);
+    if(pmd==NULL||!PTE_IS_BLOCK(*pmd))return false;
+    if(va!=HUGE_PAGE_BASE(va)||va+HUGE_PAGE_SIZE>end)return false;
+    kfree_huge_page((void*)P2K(PTE_ADDRESS(*pmd)));
+    *pmd=NULL;
+    return true;
+}
+
 /*
  * Copy len bytes from p to user address va in page table pgdir.
  * Allocate physical pages if required.
@@ -122,6 +264,7 @@ int copyout(struct pgdir *pd, void *va, void *p, usize len)
         if(*pte&PTE_VALID)page=(void*)P2K(PTE_ADDRESS(*pte));
         else{
             page=kalloc_page();
+            memset(page,0,PAGE_SIZE);
             *pte=K2P(page)|PTE_USER_DATA;
         }
 
@@ -2,17 +2,36 @@
 
 #include <aarch64/mmu.h>
 #include <common/list.h>
+#include <common/rbtree.h>
+
+// a range of user addresses, either a section or a file mapping.
+struct region {
+    struct rb_node_ rbnode;
+    bool vma;
+};
 
 struct pgdir {
     PTEntriesPtr pt;
     SpinLock lock;
     ListNode section_head;
+    // sections and mappings together, by address. they never overlap.
+    struct rb_root_ regions;
+    // generation and ASID that tag the TLB entries of this address space,
+    // assigned by attach_pgdir. 0 if it has none yet.
+    u64 asid;
 };
 
 void init_pgdir(struct pgdir *pgdir);
 WARN_RESULT PTEntriesPtr get_pte(struct pgdir *pgdir, u64 va, bool alloc);
+// the level 2 entry for 'va': a block entry, a table entry, or invalid.
+WARN_RESULT PTEntriesPtr get_block_pte(struct pgdir *pgdir, u64 va, bool alloc);
 void free_pgdir(struct pgdir *pgdir);
 void attach_pgdir(struct pgdir *pgdir);
 void vmmap(struct pgdir *pd, u64 va, void *ka, u64 flags);
 void vmunmap(struct pgdir *pd, u64 va);
-int copyout(struct pgdir *pd, void *va, void *p, usize len);
\ No newline at end of file
+void vmmap_huge(struct pgdir *pd, u64 va, void *ka, u64 flags);
+WARN_RESULT bool vmunmap_huge(struct pgdir *pd, u64 va, u64 end);
+int copyout(struct pgdir *pd, void *va, void *p, usize len);
+// invalidate the TLB entries of one page, or of the whole address space.
+void flush_tlb_page(struct pgdir *pd, u64 va);
+void flush_tlb_pgdir(struct pgdir *pd);
\ No newline at end of file
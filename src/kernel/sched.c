@@ -10,8 +10,84 @@ extern bool panic_flag;
 
 extern void swtch(KernelContext *new_ctx, KernelContext **old_ctx);
 
-static SpinLock schlock;
-static ListNode schqueue;
+// Every CPU owns a run queue in cpus[i].sched, protected by its own lock.
+// A proc belongs to the run queue of schinfo.cpu, and that field is only
+// changed with the run queue locked, so the lock also guards the proc state.
+// The running proc is never on a run queue.
+//
+// The run queue is an rbtree ordered by virtual runtime: a proc's vruntime
+// grows by its real runtime scaled by NICE_0_WEIGHT/weight, and the proc
+// with the smallest vruntime runs next.
+
+// weight of nice -20..19, each step is about 10% of CPU time
+static const u32 nice_to_weight[NICE_MAX - NICE_MIN + 1] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+    9548,  7620,  6100,  4904,  3906,
+    3121,  2501,  1991,  1586,  1277,
+    1024,  820,   655,   526,   423,
+    335,   272,   215,   172,   137,
+    110,   87,    70,    56,    45,
+    36,    29,    23,    18,    15,
+};
+
+static bool __sched_cmp(rb_node lnode, rb_node rnode)
+{
+    i64 d = container_of(lnode, struct schinfo, rbnode)->vruntime -
+            container_of(rnode, struct schinfo, rbnode)->vruntime;
+    if (d < 0)
+        return true;
+    if (d == 0)
+        return lnode < rnode;
+    return false;
+}
+
+static void enqueue_proc(struct sched *s, Proc *p)
+{
+    ASSERT(0 == _rb_insert(&p->schinfo.rbnode, &s->rq, __sched_cmp));
+    s->nr_running++;
+}
+
+static void dequeue_proc(struct sched *s, Proc *p)
+{
+    _rb_erase(&p->schinfo.rbnode, &s->rq);
+    s->nr_running--;
+}
+
+// charge the time p has been running since exec_start to its vruntime
+static void update_curr(Proc *p)
+{
+    u64 now = get_timestamp();
+    u64 delta = now - p->schinfo.exec_start;
+    p->schinfo.exec_start = now;
+    p->schinfo.vruntime += delta * NICE_0_WEIGHT / p->schinfo.weight;
+}
+
+// a waking proc may be behind by at most SCHED_WAKEUP_BONUS_MS, so long
+// sleepers get a quick turn but can't monopolize the CPU afterwards
+static void place_proc(struct sched *s, Proc *p, bool initial)
+{
+    if (initial) {
+        p->schinfo.vruntime = s->min_vruntime;
+        return;
+    }
+    u64 floor = s->min_vruntime -
+                get_clock_frequency() / 1000 * SCHED_WAKEUP_BONUS_MS;
+    if ((i64)(p->schinfo.vruntime - floor) < 0)
+        p->schinfo.vruntime = floor;
+}
+
+// lock the run queue p belongs to
+static struct sched *lock_proc_rq(Proc *p)
+{
+    while (1) {
+        auto s = &cpus[p->schinfo.cpu].sched;
+        acquire_spinlock(&s->lock);
+        if (s == &cpus[p->schinfo.cpu].sched)
+            return s;
+        release_spinlock(&s->lock);
+    }
+}
 
 void sched_timer_handler(struct timer* timer){
     timer->data=0;
@@ -26,12 +102,16 @@ void init_sched()
     // TODO: initialize the scheduler
     // 1. initialize the resources (e.g. locks, semaphores)
     // 2. initialize the scheduler info of each CPU
-    init_spinlock(&schlock);
-    init_list_node(&schqueue);
     for(int i=0;i<NCPU;i++){
+        init_spinlock(&cpus[i].sched.lock);
+        cpus[i].sched.rq.rb_node=NULL;
+        cpus[i].sched.nr_running=0;
+        cpus[i].sched.min_vruntime=0;
+
         Proc* p=create_proc();
         p->idle=1;
         p->state=RUNNING;
+        p->schinfo.cpu=i;
         cpus[i].sched.idle=p;
         cpus[i].sched.thisproc=p;
 
@@ -52,36 +132,54 @@ Proc *thisproc()
 void init_schinfo(struct schinfo *p)
 {
     // TODO: initialize your customized schinfo for every newly-created process
-    init_list_node(&p->ptnode);
+    p->cpu=cpuid();
+    p->vruntime=0;
+    p->exec_start=0;
+    p->nice=0;
+    p->weight=NICE_0_WEIGHT;
+}
+
+int sched_get_nice(Proc *p)
+{
+    return p->schinfo.nice;
+}
+
+void sched_set_nice(Proc *p, int nice)
+{
+    nice = MIN(MAX(nice, NICE_MIN), NICE_MAX);
+    auto s = lock_proc_rq(p);
+    p->schinfo.nice = nice;
+    p->schinfo.weight = nice_to_weight[nice - NICE_MIN];
+    release_spinlock(&s->lock);
 }
 
 void acquire_sched_lock()
 {
     // TODO: acquire the sched_lock if need
-    acquire_spinlock(&schlock);
+    acquire_spinlock(&cpus[cpuid()].sched.lock);
 }
 
 void release_sched_lock()
 {
     // TODO: release the sched_lock if need
-    release_spinlock(&schlock);
+    release_spinlock(&cpus[cpuid()].sched.lock);
 }
 
 bool is_zombie(Proc *p)
 {
     bool r;
-    acquire_sched_lock();
+    auto s = lock_proc_rq(p);
     r = p->state == ZOMBIE;
-    release_sched_lock();
+    release_spinlock(&s->lock);
     return r;
 }
 
 bool is_unused(Proc *p)
 {
     bool r;
-    acquire_sched_lock();
+    auto s = lock_proc_rq(p);
     r = p->state == UNUSED;
-    release_sched_lock();
+    release_spinlock(&s->lock);
     return r;
 }
 
@@ -91,17 +189,18 @@ bool _activate_proc(Proc *p, bool onalert)
     // if the proc->state is RUNNING/RUNNABLE, do nothing and return false
     // if the proc->state is SLEEPING/UNUSED, set the process state to RUNNABLE, add it to the sched queue, and return true
     // if the proc->state is DEEPSLEEPING, do nothing if onalert or activate it if else, and return the corresponding value.
-    acquire_sched_lock();
+    auto s=lock_proc_rq(p);
 
     if (p->state==RUNNING||p->state==RUNNABLE||(p->state==DEEPSLEEPING&&onalert)){
-        release_sched_lock();
+        release_spinlock(&s->lock);
         return false;
     }
     
     if(p->state==SLEEPING||p->state==UNUSED||(p->state==DEEPSLEEPING&&!onalert)){
+        place_proc(s,p,p->state==UNUSED);
         p->state=RUNNABLE;
-        _insert_into_list(&schqueue,&p->schinfo.ptnode);
-        release_sched_lock();
+        enqueue_proc(s,p);
+        release_spinlock(&s->lock);
         return true;
     }
     PANIC();
@@ -112,30 +211,55 @@ static void update_this_state(enum procstate new_state)
 {
     // TODO: if you use template sched function, you should implement this routinue
     // update the state of current process to new_state, and modify the sched queue if necessary
-    Proc* this=thisproc();
-    if(this!=cpus[cpuid()].sched.idle&&(this->state==RUNNING||this->state==RUNNABLE)){
-        _detach_from_list(&this->schinfo.ptnode);
-    }
+    auto s=&cpus[cpuid()].sched;
+    Proc* this=s->thisproc;
+    if(this!=s->idle)
+        update_curr(this);
     this->state=new_state;
-    if(this!=cpus[cpuid()].sched.idle&&(this->state==RUNNING||this->state==RUNNABLE)){
-        _insert_into_list(&schqueue,&this->schinfo.ptnode);
+    if(this!=s->idle&&new_state==RUNNABLE)
+        enqueue_proc(s,this);
+}
+
+// move one runnable proc from the busiest other CPU to s.
+// only try_acquire the victim since we are holding our own run queue lock.
+static bool steal_proc(struct sched *s)
+{
+    int me=cpuid();
+    struct sched* victim=NULL;
+    int most=0;
+    for(int i=0;i<NCPU;i++){
+        int n=__atomic_load_n(&cpus[i].sched.nr_running,__ATOMIC_RELAXED);
+        if(i!=me&&n>most){
+            victim=&cpus[i].sched;
+            most=n;
+        }
+    }
+    if(victim==NULL||!try_acquire_spinlock(&victim->lock))return false;
+    auto node=_rb_first(&victim->rq);
+    if(node==NULL){
+        release_spinlock(&victim->lock);
+        return false;
     }
+    Proc* p=container_of(node,Proc,schinfo.rbnode);
+    dequeue_proc(victim,p);
+    // vruntime is relative to the run queue it lives on
+    p->schinfo.vruntime=p->schinfo.vruntime-victim->min_vruntime+s->min_vruntime;
+    p->schinfo.cpu=me;
+    release_spinlock(&victim->lock);
+    enqueue_proc(s,p);
+    return true;
 }
 
 static Proc *pick_next()
 {
     // TODO: if using template sched function, you should implement this routinue
     // choose the next process to run, and return idle if no runnable process
-
-    if(_empty_list(&schqueue))return cpus[cpuid()].sched.idle;
-    Proc* ret=cpus[cpuid()].sched.idle;
-    for(ListNode* p=schqueue.prev;p!=&schqueue;p=p->prev){
-        Proc* proc=container_of(p,Proc,schinfo.ptnode);
-        if(proc->state==RUNNABLE){
-            ret=proc;
-            break;
-        }
-    }
+    auto s=&cpus[cpuid()].sched;
+    if(s->rq.rb_node==NULL&&!steal_proc(s))return s->idle;
+    Proc* ret=container_of(_rb_first(&s->rq),Proc,schinfo.rbnode);
+    dequeue_proc(s,ret);
+    if((i64)(ret->schinfo.vruntime-s->min_vruntime)>0)
+        s->min_vruntime=ret->schinfo.vruntime;
     return ret;
 }
 
@@ -144,6 +268,7 @@ static void update_this_proc(Proc *p)
     // TODO: you should implement this routinue
     // update thisproc to the choosen process
     cpus[cpuid()].sched.thisproc=p;
+    p->schinfo.exec_start=get_timestamp();
 
     if(!cpus[cpuid()].sched.sched_timer.triggered){
         cancel_cpu_timer(&cpus[cpuid()].sched.sched_timer);
@@ -2,8 +2,15 @@
 
 #include <kernel/proc.h>
 
+#define NICE_MIN -20
+#define NICE_MAX 19
+#define NICE_0_WEIGHT 1024
+#define SCHED_WAKEUP_BONUS_MS 3
+
 void init_sched();
 void init_schinfo(struct schinfo *);
+int sched_get_nice(Proc *);
+void sched_set_nice(Proc *, int nice);
 
 bool _activate_proc(Proc *, bool onalert);
 #define activate_proc(proc) _activate_proc(proc, false)
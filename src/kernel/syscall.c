@@ -47,13 +47,11 @@ void syscall_entry(UserContext *context)
 bool user_readable(const void *start, usize size) {
     /* (Final) TODO BEGIN */
     if((u64)start>=KSPACE_MASK)return true;
-    auto st_head=&thisproc()->pgdir.section_head;
-    _for_in_list(p,st_head){
-        if(p==st_head)break;
-        auto sec=container_of(p,struct section,stnode);
-        if(sec->begin<=(u64)start&&(u64)start+size<=sec->end)return true;
-    }
-    return false;
+    auto r=region_lookup(&thisproc()->pgdir,(u64)start);
+    if(r==NULL||(u64)start+size>region_end(r))return false;
+    // the pages are present from here on, as the caller may touch them
+    // while holding a spinlock.
+    return populate_user((u64)start,(u64)start+size,false)==0;
     /* (Final) TODO END */
 }
 
@@ -65,13 +63,11 @@ bool user_readable(const void *start, usize size) {
 bool user_writeable(const void *start, usize size) {
     /* (Final) TODO Begin */
     if((u64)start>=KSPACE_MASK)return true;
-    auto st_head=&thisproc()->pgdir.section_head;
-    _for_in_list(p,st_head){
-        if(p==st_head)break;
-        auto sec=container_of(p,struct section,stnode);
-        if(!(sec->flags&ST_RO)&&sec->begin<=(u64)start&&(u64)start+size<=sec->end)return true;
-    }
-    return false;
+    auto r=region_lookup(&thisproc()->pgdir,(u64)start);
+    if(r==NULL||(u64)start+size>region_end(r))return false;
+    if(r->vma&&(container_of(r,struct vma,region)->permission&PTE_RO))return false;
+    if(!r->vma&&(container_of(r,struct section,region)->flags&ST_RO))return false;
+    return populate_user((u64)start,(u64)start+size,true)==0;
     /* (Final) TODO End */
 }
 
@@ -76,15 +76,19 @@ define_syscall(mmap, void *addr, int length, int prot, int flags, int fd,
 {
     /* (Final) TODO BEGIN */
     auto proc=thisproc();
-    auto f=proc->oftable.file[fd];
+    if(length<=0)return -1;
+    // anonymous memory ignores `fd` and starts zeroed.
+    struct file* f=NULL;
+    bool anon=flags&MAP_ANONYMOUS;
+    if(!anon){
+        if(fd<0||fd>=NOFILE)return -1;
+        f=proc->oftable.file[fd];
+        if(f==NULL)return -1;
+        if((prot&PROT_WRITE)&&!f->writable&&!(flags&MAP_PRIVATE))return -1;
+        if((prot&PROT_READ)&&!f->readable)return -1;
+    }
 
     int pte_flag=PTE_USER_DATA;
-    if(prot&PROT_WRITE){
-        if(!f->writable&&!(flags&MAP_PRIVATE))return -1;
-    }
-    if(prot&PROT_READ){
-        if(!f->readable)return -1;
-    }
     if(!(prot&PROT_WRITE))pte_flag|=PTE_RO;
 
     struct vma* v=kalloc(sizeof(struct vma));
@@ -93,22 +97,31 @@ define_syscall(mmap, void *addr, int length, int prot, int flags, int fd,
     v->off=offset;
     v->file=f;
     v->flags=flags;
-    file_dup(f);
-
-    u64 start=MMAP_START;
-    if(addr){
-        start=(u64)addr;
-    }
-    else if(!_empty_list(&proc->vma_head)){
-        auto vma=container_of(proc->vma_head.next,struct vma,ptnode);
-        start=vma->end;
-    }
-    if(start!=PAGE_BASE(start))start=PAGE_BASE(start)+PAGE_SIZE;
+    if(f)file_dup(f);
+
+    // `addr` is a hint: it is taken if the range there is free, otherwise
+    // the mapping goes to the lowest hole that fits. anonymous memory of
+    // 2 MiB or more goes on a 2 MiB boundary, so that the page fault
+    // handler can map it with blocks; MAP_HUGETLB also rounds it up to
+    // whole blocks.
+    u64 size=PAGE_BASE(((u64)length+PAGE_SIZE-1));
+    u64 align=PAGE_SIZE;
+    if(anon&&(flags&MAP_HUGETLB))size=HUGE_PAGE_BASE(size+HUGE_PAGE_SIZE-1);
+    if(anon&&size>=HUGE_PAGE_SIZE)align=HUGE_PAGE_SIZE;
+    u64 start=PAGE_BASE(((u64)addr+PAGE_SIZE-1));
     v->start=start;
-    v->end=v->start+length;
-    _insert_into_list(&proc->vma_head,&v->ptnode);
-
-    printk("mmap:addr %llx,length: %x\n",(u64)v->start,length);
+    v->end=start+size;
+    if(addr==NULL||vma_add(proc,v)!=0){
+        start=region_find_gap(&proc->pgdir,MMAP_START,size,align);
+        if(start==0){
+            if(f)file_close(f);
+            kfree(v);
+            return -1;
+        }
+        v->start=start;
+        v->end=start+size;
+        if(vma_add(proc,v)!=0)PANIC();
+    }
 
     return v->start;
     /* (Final) TODO END */
@@ -117,42 +130,67 @@ define_syscall(mmap, void *addr, int length, int prot, int flags, int fd,
 define_syscall(munmap, void *addr, size_t length)
 {
     /* (Final) TODO BEGIN */
-    printk("munmap:addr %llx,length: %llx\n",(u64)addr,(u64)length);
+    u64 begin=(u64)addr,end=begin+PAGE_BASE((length+PAGE_SIZE-1));
+    if(begin!=PAGE_BASE(begin)||length==0)return -1;
     auto proc=thisproc();
-    struct vma* vma=NULL;
-    _for_in_list(p,&proc->vma_head){
-        auto v=container_of(p,struct vma,ptnode);
-        if(v->start<=(u64)addr&&(u64)addr+length<=v->end){
-            vma=v;
-            break;
+    // every mapping in the range loses its part of it, and one that reaches
+    // past both ends is split in two.
+    struct region* r;
+    while((r=region_next(&proc->pgdir,begin))!=NULL&&region_begin(r)<end){
+        if(!r->vma){
+            begin=region_end(r);
+            continue;
         }
-    }
-    if(!vma)return -1;
-    if((u64)addr==vma->start&&length<=vma->length){
-        vma_writeback(vma,length);
-        for(u64 i=0;i<length;i+=PAGE_SIZE){
-            vmunmap(&proc->pgdir,(u64)addr+i);
+        auto v=container_of(r,struct vma,region);
+        u64 l=MAX(begin,v->start),h=MIN(end,v->end);
+        vma_unmap(v,l,h);
+        begin=h;
+        if(l==v->start&&h==v->end){
+            vma_remove(proc,v);
+            continue;
+        }
+        if(l==v->start){
+            v->off+=h-v->start;
+            v->start=h;
         }
-        arch_tlbi_vmalle1is();
-        if(length==vma->length){
-            file_close(vma->file);
-            _detach_from_list(&vma->ptnode);
-            kfree(vma);
+        else if(h==v->end){
+            v->end=l;
         }
         else{
-            vma->start+=length;
-            vma->off+=length;
-            vma->length-=length;
+            struct vma* nv=kalloc(sizeof(struct vma));
+            memmove(nv,v,sizeof(struct vma));
+            nv->start=h;
+            nv->off=v->off+(h-v->start);
+            nv->length=nv->end-nv->start;
+            if(v->file)nv->file=file_dup(v->file);
+            v->end=l;
+            if(vma_add(proc,nv)!=0)PANIC();
         }
-    }
-    else{
-        printk("munmap parameter error!\n");
-        return -1;
+        v->length=v->end-v->start;
     }
     return 0;
     /* (Final) TODO END */
 }
 
+define_syscall(msync, void *addr, size_t length, int flags)
+{
+    if((u64)addr!=PAGE_BASE(addr))return -1;
+    (void)flags;
+    // writeback is synchronous, so MS_ASYNC and MS_SYNC do the same.
+    auto proc=thisproc();
+    u64 begin=(u64)addr,end=begin+length;
+    bool found=false;
+    struct region* r;
+    while((r=region_next(&proc->pgdir,begin))!=NULL&&region_begin(r)<end){
+        begin=region_end(r);
+        if(!r->vma)continue;
+        auto v=container_of(r,struct vma,region);
+        vma_writeback(v,MAX((u64)addr,v->start),MIN(end,v->end));
+        found=true;
+    }
+    return found?0:-1;
+}
+
 define_syscall(dup, int fd)
 {
     struct file *f = fd2file(fd);
@@ -249,10 +287,13 @@ static int isdirempty(Inode *dp)
     usize off;
     DirEntry de;
 
-    for (off = 2 * sizeof(de); off < dp->entry.num_bytes; off += sizeof(de)) {
+    // "." and ".." are not the first two entries of an indexed directory.
+    for (off = 0; off < dp->entry.num_bytes; off += sizeof(de)) {
         if (inodes.read(dp, (u8 *)&de, off, sizeof(de)) != sizeof(de))
             PANIC();
-        if (de.inode_no != 0)
+        if (de.inode_no != 0 &&
+            strncmp(de.name, ".", FILE_NAME_MAX_LENGTH) != 0 &&
+            strncmp(de.name, "..", FILE_NAME_MAX_LENGTH) != 0)
             return 0;
     }
     return 1;
@@ -262,7 +303,6 @@ define_syscall(unlinkat, int fd, const char *path, int flag)
 {
     ASSERT(fd == AT_FDCWD && flag == 0);
     Inode *ip, *dp;
-    DirEntry de;
     char name[FILE_NAME_MAX_LENGTH];
     usize off;
     if (!user_strlen(path, 256))
@@ -295,9 +335,8 @@ define_syscall(unlinkat, int fd, const char *path, int flag)
         goto bad;
     }
 
-    memset(&de, 0, sizeof(de));
-    if (inodes.write(&ctx, dp, (u8 *)&de, off, sizeof(de)) != sizeof(de))
-        PANIC();
+    // through the inode layer, so that the dcache sees it.
+    inodes.remove(&ctx, dp, off);
     if (ip->entry.type == INODE_DIRECTORY) {
         dp->entry.num_links--;
         inodes.sync(&ctx, dp, true);
@@ -356,7 +395,7 @@ Inode *create(const char *path, short type, short major, short minor,
         inodes.put(ctx,ip);
         return NULL;
     }
-    ip=inodes.get(inodes.alloc(ctx,type));
+    ip=inodes.get(inodes.alloc_near(ctx,type,dir->inode_no));
     inodes.lock(ip);
     ip->entry.major=major;
     ip->entry.minor=minor;
@@ -26,6 +26,21 @@ define_syscall(yield) {
     return 0;
 }
 
+// only PRIO_PROCESS is supported, who == 0 means the caller
+define_syscall(setpriority, int which, int who, int prio) {
+    if (which != 0)
+        return -1;
+    return setnice(who ? who : thisproc()->pid, prio);
+}
+
+// like the raw linux syscall, return 20 - nice so that it's never negative
+define_syscall(getpriority, int which, int who) {
+    int nice;
+    if (which != 0 || getnice(who ? who : thisproc()->pid, &nice) < 0)
+        return -1;
+    return 20 - nice;
+}
+
 define_syscall(pstat) { return (u64)left_page_cnt(); }
 
 define_syscall(sbrk, i64 size) { return sbrk(size); }
@@ -0,0 +1,75 @@
+#include <aarch64/intrinsic.h>
+#include <aarch64/mmu.h>
+#include <common/sem.h>
+#include <kernel/mem.h>
+#include <kernel/printk.h>
+#include <kernel/proc.h>
+#include <kernel/pt.h>
+#include <kernel/sched.h>
+#include <test/test.h>
+
+extern bool asid_enabled;
+
+void set_parent_to_this(Proc *proc);
+
+#define CTXSW_ROUNDS 4096
+#define CTXSW_PAGES 64
+
+static Semaphore ping, pong;
+
+// map CTXSW_PAGES pages at address 0 of this process, then touch all of
+// them between every two switches, ping-ponging with the other process.
+static void ctxsw_proc(u64 id)
+{
+    auto pd = &thisproc()->pgdir;
+    for (u64 i = 0; i < CTXSW_PAGES; i++)
+        vmmap(pd, i * PAGE_SIZE, kalloc_page(), PTE_USER_DATA);
+    attach_pgdir(pd);
+
+    for (int r = 0; r < CTXSW_ROUNDS; r++) {
+        for (u64 i = 0; i < CTXSW_PAGES; i++)
+            (void)*(volatile u64 *)(i * PAGE_SIZE);
+        if (id == 0) {
+            post_sem(&ping);
+            unalertable_wait_sem(&pong);
+        } else {
+            unalertable_wait_sem(&ping);
+            post_sem(&pong);
+        }
+    }
+
+    for (u64 i = 0; i < CTXSW_PAGES; i++)
+        vmunmap(pd, i * PAGE_SIZE);
+    flush_tlb_pgdir(pd);
+    exit(0);
+}
+
+// report the round trips per second of two processes in different address
+// spaces.
+static void ctxsw_bench(const char *name)
+{
+    init_sem(&ping, 0);
+    init_sem(&pong, 0);
+    u64 t0 = get_timestamp();
+    for (int i = 0; i < 2; i++) {
+        auto p = create_proc();
+        set_parent_to_this(p);
+        start_proc(p, ctxsw_proc, i);
+    }
+    int code;
+    for (int i = 0; i < 2; i++)
+        ASSERT(wait(&code) != -1);
+    u64 t = get_timestamp() - t0;
+    printk("%s: %lld round trips/sec\n", name,
+           (u64)CTXSW_ROUNDS * get_clock_frequency() / t);
+}
+
+void ctxsw_test()
+{
+    printk("ctxsw_test\n");
+    ctxsw_bench("with ASIDs");
+    asid_enabled = false;
+    ctxsw_bench("without ASIDs");
+    asid_enabled = true;
+    printk("ctxsw_test PASS\n");
+}
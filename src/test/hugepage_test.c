@@ -0,0 +1,54 @@
+#include <aarch64/mmu.h>
+#include <common/string.h>
+#include <kernel/mem.h>
+#include <kernel/printk.h>
+#include <kernel/pt.h>
+#include <test/test.h>
+
+#define VA (4 * HUGE_PAGE_SIZE)
+
+// map a 2 MiB page with a block entry in a pgdir of our own, share it as
+// fork does, split one of the mappings by asking for a page of it, and
+// check that the chunk goes back to the pool when the last page is gone.
+void hugepage_test()
+{
+    printk("hugepage_test\n");
+    u64 left = left_huge_page_cnt();
+    struct pgdir a, b;
+    init_pgdir(&a);
+    init_pgdir(&b);
+
+    u8 *p = kalloc_huge_page();
+    ASSERT(p != NULL);
+    ASSERT((u64)p == HUGE_PAGE_BASE(p));
+    ASSERT(left_huge_page_cnt() == left - 1);
+    for (u64 i = 0; i < HUGE_PAGE_SIZE; i += PAGE_SIZE)
+        p[i] = (u8)(i / PAGE_SIZE);
+    vmmap_huge(&a, VA, p, PTE_USER_DATA);
+    vmmap_huge(&b, VA, kshare_huge_page(p), PTE_USER_DATA | PTE_RO);
+    ASSERT(huge_page_refcount(p) == 2);
+    ASSERT(PTE_IS_BLOCK(*get_block_pte(&a, VA, false)));
+
+    // the split keeps the flags and the frames of the block.
+    auto pte = get_pte(&b, VA + 3 * PAGE_SIZE, false);
+    ASSERT(pte != NULL);
+    ASSERT(PTE_ADDRESS(*pte) == K2P(p + 3 * PAGE_SIZE));
+    ASSERT(*pte & PTE_RO);
+    ASSERT(!PTE_IS_BLOCK(*get_block_pte(&b, VA, false)));
+    ASSERT(*(u8 *)P2K(PTE_ADDRESS(*pte)) == 3);
+    ASSERT(page_refcount(p + 3 * PAGE_SIZE) == 2);
+    ASSERT(huge_page_refcount(p) == 1 + N_PTE_PER_TABLE);
+
+    // a block only goes at once if all of it is to go.
+    ASSERT(!vmunmap_huge(&a, VA, VA + HUGE_PAGE_SIZE - PAGE_SIZE));
+    ASSERT(vmunmap_huge(&a, VA, VA + HUGE_PAGE_SIZE));
+    ASSERT(page_refcount(p + 3 * PAGE_SIZE) == 1);
+    ASSERT(left_huge_page_cnt() == left - 1);
+    for (u64 i = 0; i < HUGE_PAGE_SIZE; i += PAGE_SIZE)
+        vmunmap(&b, VA + i);
+    ASSERT(left_huge_page_cnt() == left);
+
+    free_pgdir(&a);
+    free_pgdir(&b);
+    printk("hugepage_test PASS\n");
+}
@@ -7,6 +7,7 @@
 #include <test/test.h>
 
 extern RefCount kalloc_page_cnt;
+extern bool page_cache_enabled;
 
 static RefCount x;
 static void *p[4][10000];
@@ -23,6 +24,23 @@ static short sz[4][10000];
     while (x.count < 4 * i); \
     arch_dsb_sy();
 
+#define BENCH_ROUNDS 256
+#define BENCH_PAGES 256
+
+// allocate and free BENCH_PAGES pages BENCH_ROUNDS times and report the rate
+static void page_bench(int i, const char *name) {
+    u64 t0 = get_timestamp();
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        for (int j = 0; j < BENCH_PAGES; j++)
+            p[i][j] = kalloc_page();
+        for (int j = 0; j < BENCH_PAGES; j++)
+            kfree_page(p[i][j]);
+    }
+    u64 t = get_timestamp() - t0;
+    printk("CPU %d %s: %lld pages/sec\n", i, name,
+           (u64)BENCH_ROUNDS * BENCH_PAGES * get_clock_frequency() / t);
+}
+
 void kalloc_test() {
     int i = cpuid();
     int r = kalloc_page_cnt.count;
@@ -47,6 +65,16 @@ void kalloc_test() {
     if (kalloc_page_cnt.count != r)
         FAIL("FAIL: kalloc_page_cnt %d -> %lld\n", r, kalloc_page_cnt.count);
     SYNC(3)
+    page_bench(i, "with page cache");
+    SYNC(4)
+    if (i == 0)
+        page_cache_enabled = false;
+    SYNC(5)
+    page_bench(i, "without page cache");
+    SYNC(6)
+    if (i == 0)
+        page_cache_enabled = true;
+    SYNC(7)
     for (int j = 0; j < 10000;) {
         if (j < 1000 || rand() > RAND_MAX / 16 * 7) {
             int z = 0;
@@ -88,18 +116,19 @@ void kalloc_test() {
             sz[i][k] = sz[i][j];
         }
     }
-    SYNC(4)
+    SYNC(8)
     if (cpuid() == 0) {
         i64 z = 0;
         for (int j = 0; j < 4; j++)
             for (int k = 0; k < 10000; k++)
                 z += sz[j][k];
         printk("Total: %lld\nUsage: %lld\n", z, kalloc_page_cnt.count - r);
+        kmem_report();
     }
-    SYNC(5)
+    SYNC(9)
     for (int j = 0; j < 10000; j++)
         kfree(p[i][j]);
-    SYNC(6)
+    SYNC(10)
     if (cpuid() == 0)
         printk("kalloc_test PASS\n");
 }
@@ -64,6 +64,16 @@ void rbtree_test()
     while (x.count < 8)
         ;
     arch_dsb_sy();
-    if (cid == 0)
+    if (cid == 0) {
+        int n = 0, last = -1;
+        for (rb_node np = _rb_first(&rt); np; np = _rb_next(np), n++) {
+            int key = container_of(np, struct mytype, node)->key;
+            if (key <= last)
+                FAIL("order error! %d %d\n", last, key);
+            last = key;
+        }
+        if (n != 4000)
+            FAIL("walked %d nodes\n", n);
         printk("rbtree_test PASS\n");
+    }
 }
\ No newline at end of file
@@ -9,6 +9,8 @@ void proc_test();
 void vm_test();
 void user_proc_test();
 void io_test();
+void ctxsw_test();
+void hugepage_test();
 unsigned rand();
 void srand(unsigned seed);
 
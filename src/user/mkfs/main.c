@@ -58,6 +58,7 @@ void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+void dirinsert(uint dino, const char *name, uint inum);
 
 // convert to little-endian byte order
 ushort xshort(ushort x)
@@ -84,17 +85,33 @@ int main(int argc, char *argv[])
 {
     int i, cc, fd;
     uint rootino, inum, off;
-    struct dirent de;
     char buf[BSIZE];
     InodeEntry din;
 
     static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
-    if (argc < 2) {
-        fprintf(stderr, "Usage: mkfs fs.img files...\n");
+    // number of hash buckets of the root directory, 0 for a linear one.
+    int nbuckets = -1;
+    if (argc >= 3 && strcmp(argv[1], "-i") == 0) {
+        nbuckets = atoi(argv[2]);
+        argv += 2;
+        argc -= 2;
+    }
+
+    if (argc < 2 || nbuckets > (int)(NDIRECT + NINDIRECT)) {
+        fprintf(stderr, "Usage: mkfs [-i buckets] fs.img files...\n");
         exit(1);
     }
 
+    // by default, index the root directory once it outgrows one block,
+    // keeping the buckets at most half full.
+    if (nbuckets < 0) {
+        int nentries = argc - 2 + 2;
+        nbuckets = 0;
+        if (nentries > (int)DIR_PER_BLOCK)
+            nbuckets = (nentries * 2 + DIR_PER_BLOCK - 1) / DIR_PER_BLOCK;
+    }
+
     assert((BSIZE % sizeof(struct dinode)) == 0);
     assert((BSIZE % sizeof(struct dirent)) == 0);
 
@@ -133,15 +150,17 @@ int main(int argc, char *argv[])
     rootino = ialloc(INODE_DIRECTORY);
     assert(rootino == ROOT_INODE_NO);
 
-    bzero(&de, sizeof(de));
-    de.inode_no = xshort(rootino);
-    strcpy(de.name, ".");
-    iappend(rootino, &de, sizeof(de));
+    if (nbuckets > 0) {
+        printf("root directory: %d hash buckets\n", nbuckets);
+        for (i = 0; i < nbuckets; i++)
+            iappend(rootino, zeroes, BSIZE);
+        rinode(rootino, &din);
+        din.major = xshort(nbuckets);
+        winode(rootino, &din);
+    }
 
-    bzero(&de, sizeof(de));
-    de.inode_no = xshort(rootino);
-    strcpy(de.name, "..");
-    iappend(rootino, &de, sizeof(de));
+    dirinsert(rootino, ".", rootino);
+    dirinsert(rootino, "..", rootino);
 
     for (i = 2; i < argc; i++) {
         char *path = argv[i];
@@ -169,11 +188,7 @@ int main(int argc, char *argv[])
             ++argv[i];
 
         inum = ialloc(INODE_REGULAR);
-
-        bzero(&de, sizeof(de));
-        de.inode_no = xshort(inum);
-        strncpy(de.name, argv[i], DIRSIZ);
-        iappend(rootino, &de, sizeof(de));
+        dirinsert(rootino, argv[i], inum);
 
         while ((cc = read(fd, buf, sizeof(buf))) > 0)
             iappend(inum, buf, cc);
@@ -184,9 +199,11 @@ int main(int argc, char *argv[])
     // fix size of root inode dir
     rinode(rootino, &din);
     off = xint(din.num_bytes);
-    off = ((off / BSIZE) + 1) * BSIZE;
-    din.num_bytes = xint(off);
-    winode(rootino, &din);
+    if (off % BSIZE != 0) {
+        off = ((off / BSIZE) + 1) * BSIZE;
+        din.num_bytes = xint(off);
+        winode(rootino, &din);
+    }
 
     balloc(freeblock);
 
@@ -258,27 +275,77 @@ uint ialloc(ushort type)
 void balloc(int used)
 {
     uchar buf[BSIZE];
-    int i;
+    int i, b;
 
     printf("balloc: first %d blocks have been allocated\n", used);
-    assert(used < BSIZE * 8);
-    bzero(buf, BSIZE);
-    for (i = 0; i < used; i++) {
-        buf[i / 8] = buf[i / 8] | (0x1 << (i % 8));
+    assert(used < nbitmap * BSIZE * 8);
+    for (b = 0; b < nbitmap; b++) {
+        bzero(buf, BSIZE);
+        for (i = 0; i < BSIZE * 8 && b * BSIZE * 8 + i < used; i++) {
+            buf[i / 8] = buf[i / 8] | (0x1 << (i % 8));
+        }
+        printf("balloc: write bitmap block at sector %d\n", sb.bitmap_start + b);
+        wsect(sb.bitmap_start + b, buf);
     }
-    printf("balloc: write bitmap block at sector %d\n", sb.bitmap_start);
-    wsect(sb.bitmap_start, buf);
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// entry `i` of indirect block `*slot`, allocating both when missing.
+uint indirect_entry(uint *slot, uint i)
+{
+    uint indirect[NINDIRECT];
+
+    if (xint(*slot) == 0) {
+        *slot = xint(freeblock++);
+        bzero(indirect, sizeof(indirect));
+        wsect(xint(*slot), (char *)indirect);
+    }
+    rsect(xint(*slot), (char *)indirect);
+    if (indirect[i] == 0) {
+        indirect[i] = xint(freeblock++);
+        wsect(xint(*slot), (char *)indirect);
+    }
+    return xint(indirect[i]);
+}
+
+// the block number of block `fbn` of an inode, allocating it if needed.
+uint bmap(struct dinode *din, uint fbn)
+{
+    uint indirect[NINDIRECT];
+    uint slot, x;
+
+    if (fbn < NDIRECT) {
+        if (xint(din->addrs[fbn]) == 0)
+            din->addrs[fbn] = xint(freeblock++);
+        return xint(din->addrs[fbn]);
+    }
+    fbn -= NDIRECT;
+    if (fbn < NINDIRECT)
+        return indirect_entry(&din->indirect, fbn);
+    fbn -= NINDIRECT;
+    // the double indirect block, then the second level block.
+    if (xint(din->dindirect) == 0) {
+        din->dindirect = xint(freeblock++);
+        bzero(indirect, sizeof(indirect));
+        wsect(xint(din->dindirect), (char *)indirect);
+    }
+    rsect(xint(din->dindirect), (char *)indirect);
+    slot = indirect[fbn / NINDIRECT];
+    x = indirect_entry(&slot, fbn % NINDIRECT);
+    if (indirect[fbn / NINDIRECT] != slot) {
+        indirect[fbn / NINDIRECT] = slot;
+        wsect(xint(din->dindirect), (char *)indirect);
+    }
+    return x;
+}
+
 void iappend(uint inum, void *xp, int n)
 {
     char *p = (char *)xp;
     uint fbn, off, n1;
     struct dinode din;
     char buf[BSIZE];
-    uint indirect[NINDIRECT];
     uint x;
 
     rinode(inum, &din);
@@ -287,22 +354,7 @@ void iappend(uint inum, void *xp, int n)
     while (n > 0) {
         fbn = off / BSIZE;
         assert(fbn < INODE_MAX_BLOCKS);
-        if (fbn < NDIRECT) {
-            if (xint(din.addrs[fbn]) == 0) {
-                din.addrs[fbn] = xint(freeblock++);
-            }
-            x = xint(din.addrs[fbn]);
-        } else {
-            if (xint(din.indirect) == 0) {
-                din.indirect = xint(freeblock++);
-            }
-            rsect(xint(din.indirect), (char *)indirect);
-            if (indirect[fbn - NDIRECT] == 0) {
-                indirect[fbn - NDIRECT] = xint(freeblock++);
-                wsect(xint(din.indirect), (char *)indirect);
-            }
-            x = xint(indirect[fbn - NDIRECT]);
-        }
+        x = bmap(&din, fbn);
         n1 = min(n, (fbn + 1) * BSIZE - off);
         rsect(x, buf);
         bcopy(p, buf + off - (fbn * BSIZE), n1);
@@ -314,3 +366,38 @@ void iappend(uint inum, void *xp, int n)
     din.num_bytes = xint(off);
     winode(inum, &din);
 }
+
+// add `name` -> `inum` to directory `dino`, following the layout in
+// fs/defines.h for indexed directories.
+void dirinsert(uint dino, const char *name, uint inum)
+{
+    struct dinode din;
+    struct dirent de, *slots;
+    char buf[BSIZE];
+    uint n, b, k, x;
+    int i;
+
+    bzero(&de, sizeof(de));
+    de.inode_no = xshort(inum);
+    strncpy(de.name, name, DIRSIZ);
+
+    rinode(dino, &din);
+    n = xshort(din.major);
+    if (n > 0) {
+        for (k = 0; k < n; k++) {
+            b = (dir_hash(de.name) % n + k) % n;
+            x = bmap(&din, b);
+            rsect(x, buf);
+            slots = (struct dirent *)buf;
+            for (i = 0; i < (int)DIR_PER_BLOCK; i++) {
+                if (slots[i].inode_no == 0) {
+                    slots[i] = de;
+                    wsect(x, buf);
+                    return;
+                }
+            }
+        }
+    }
+    // linear directory, or every bucket is full.
+    iappend(dino, &de, sizeof(de));
+}